@@ -1,9 +1,29 @@
+/* for ppoll */
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <SDL2/SDL.h>
+#include <jpeglib.h>
+#include <zlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "keysymdef.h"
 
@@ -11,6 +31,18 @@
 
 #define VNC_INITIAL_BUFSIZE 64;
 
+/*
+ * Size of the buffer that small reads from the server are served from, and the
+ * read size above which data is received straight into its destination.
+ */
+#define VNC_RECEIVE_BUFSIZE 65536
+#define VNC_DIRECT_READ_THRESHOLD 4096
+
+/*
+ * Maximum number of separate destinations filled by a single recvmsg call.
+ */
+#define VNC_RECV_IOVECS 64
+
 typedef unsigned int uint;
 
 typedef enum {
@@ -24,18 +56,24 @@ typedef enum {
     FRAME_BUFFER_UPDATE = 0,
     SET_COLOUR_MAP_ENTRIES = 1,
     BELL = 2,
-    SERVER_CUT_TEXT = 3
+    SERVER_CUT_TEXT = 3,
+    END_OF_CONTINUOUS_UPDATES = 150,
+    FENCE = 248
 } VNC_ServerMessageType;
 
 typedef enum {
     RAW = 0,
     COPY_RECT = 1,
     RRE = 2,
+    CORRE = 4,
     HEXTILE = 5,
+    TIGHT = 7,
     TRLE = 15,
     ZRLE = 16,
 
-    PSEUDO_CONTINUOUS_UPDATES = 150,
+    PSEUDO_CONTINUOUS_UPDATES = -313,
+    PSEUDO_FENCE = -312,
+    PSEUDO_QUALITY_LEVEL_0 = -32,
     PSEUDO_CURSOR = -239,
     PSEUDO_DESKTOP_SIZE = -223
 } VNC_RectangleEncodingMethod;
@@ -45,7 +83,62 @@ typedef struct {
     VNC_RectangleEncodingMethod e;
 } VNC_RectangleHeader;
 
+/*
+ * What the parser is in the middle of reading from the server.
+ */
+typedef enum {
+    VNC_PARSE_MESSAGE_TYPE,
+    VNC_PARSE_MESSAGE,
+    VNC_PARSE_UPDATE_HEADER,
+    VNC_PARSE_RECT_HEADER,
+    VNC_PARSE_RECT,
+    VNC_PARSE_RAW_ROWS
+} VNC_ParseState;
+
+/*
+ * Incremental parser for messages from the server.
+ *
+ * A message or rectangle is only handed to its handler once all of it is in
+ * the receive buffer, so that handlers read from the buffer without ever
+ * blocking. Until then, the parser works out how long it is as its bytes
+ * arrive, keeping its place between calls; raw rectangles are written to the
+ * surface row by row as their pixels arrive instead.
+ */
+struct VNC_Parser {
+    VNC_ParseState state;
+    Uint8 message;
+    Uint16 rects_left;
+    VNC_RectangleHeader header;
+
+    /* bytes of the current message or rectangle measured so far */
+    size_t length;
+
+    /* bytes that must be buffered before parsing can go on */
+    size_t need;
+
+    /* next tile of a Hextile or TRLE rectangle to measure */
+    int tile;
+
+    /* TRLE tile being measured: subencoding, palette size and pixels so far */
+    SDL_bool in_tile;
+    Uint8 tile_sub;
+    Uint8 palette_size;
+    int pixel;
+
+    /* next row of a raw rectangle to write, and bytes of it already written */
+    int row;
+    size_t offset;
+
+    /* bytes consumed, and when data last arrived, as the update started */
+    Uint64 update_bytes;
+    Uint64 update_start;
+
+    /* error reported when parsing fails */
+    VNC_Result error;
+};
+
 int VNC_SHUTDOWN;
+int VNC_FRAME_READY;
 
 #define RFB_33_STR "RFB 003.003\n"
 #define RFB_37_STR "RFB 003.007\n"
@@ -82,6 +175,18 @@ char *VNC_ErrorString(VNC_Result err) {
         case VNC_ERROR_UNIMPLEMENTED:
             return "feature unimplemented";
 
+        case VNC_ERROR_UNSUPPORTED_PIXEL_FORMAT:
+            return "unsupported pixel format";
+
+        case VNC_ERROR_ALREADY_STARTED:
+            return "connection already started";
+
+        case VNC_ERROR_RENDERER:
+            return "could not update texture or window surface";
+
+        case VNC_ERROR_MALFORMED_DATA:
+            return "server sent malformed data";
+
         default:
             return "unknown error";
     }
@@ -113,27 +218,355 @@ int VNC_Connect(VNC_Connection *vnc, char *host, uint port) {
     return connect(vnc->socket, (struct sockaddr *) &address, sizeof(address));
 }
 
-int VNC_ResizeBuffer(VNC_ConnectionBuffer buffer, size_t n) {
-    buffer.data = realloc(buffer.data, n);
+int VNC_ResizeBuffer(VNC_ConnectionBuffer *buffer, size_t n) {
+    void *data = realloc(buffer->data, n);
+
+    if (!data) {
+        return 1;
+    }
+
+    buffer->data = data;
+    buffer->size = n;
 
-    return !buffer.data;
+    return 0;
 }
 
-int VNC_AssureBufferSize(VNC_ConnectionBuffer buffer, size_t n) {
-    if (n > buffer.size) {
+int VNC_AssureBufferSize(VNC_ConnectionBuffer *buffer, size_t n) {
+    if (n > buffer->size) {
         return VNC_ResizeBuffer(buffer, n);
     }
 
     return 0;
 }
 
-int VNC_FromServer(int socket, void *buffer, size_t n) {
+int VNC_InitReceiveBuffer(VNC_ReceiveBuffer *buffer) {
+    buffer->size = VNC_RECEIVE_BUFSIZE;
+    buffer->start = 0;
+    buffer->end = 0;
+    buffer->data = SDL_malloc(buffer->size);
+
+    return buffer->data == NULL;
+}
+
+#define VNC_NS_PER_SECOND 1000000000
+
+/*
+ * Reads the monotonic clock that update requests are timed and paced on, in
+ * nanoseconds.
+ */
+Uint64 VNC_Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (Uint64) ts.tv_sec * VNC_NS_PER_SECOND + ts.tv_nsec;
+}
+
+/*
+ * Waits until the given time on the monotonic clock, or indefinitely if 0, for
+ * a file descriptor to become readable.
+ *
+ * Returns 1 if it is readable, 0 if it is not yet, and -1 on error.
+ */
+int VNC_WaitForReadable(int fd, Uint64 deadline) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    struct timespec timeout = { 0, 0 };
+
+    if (deadline) {
+        Uint64 now = VNC_Now();
+        Uint64 left = deadline > now ? deadline - now : 0;
+
+        timeout.tv_sec = left / VNC_NS_PER_SECOND;
+        timeout.tv_nsec = left % VNC_NS_PER_SECOND;
+    }
+
+    int res = ppoll(&pfd, 1, deadline ? &timeout : NULL, NULL);
+
+    if (res < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    return res > 0;
+}
+
+/*
+ * Wakes whoever waits for the given eventfd to be readable.
+ *
+ * Returns 0 on success, and -1 on error. The eventfd is non-blocking, so a
+ * write that would block finds its counter too high to have been cleared,
+ * which is as good as signalling it again.
+ */
+int VNC_SignalEventFd(int fd) {
+    Uint64 one = 1;
+    ssize_t res;
+
+    do {
+        res = write(fd, &one, sizeof (one));
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0 && errno != EAGAIN) {
+        warn("could not signal eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Resets an eventfd, or a timerfd, to not readable.
+ *
+ * Returns 0 on success, including when it was not readable to begin with,
+ * and -1 on error.
+ */
+int VNC_ClearEventFd(int fd) {
+    Uint64 count;
+    ssize_t res;
+
+    do {
+        res = read(fd, &count, sizeof (count));
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0 && errno != EAGAIN) {
+        warn("could not clear eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Size of the ring that a connection's receiver thread receives into, which
+ * must be a power of two. Once it is full, the receiver stops reading from the
+ * socket until the polling thread has caught up, so that TCP flow control
+ * slows the server down rather than memory use growing.
+ */
+#define VNC_RING_SIZE (1 << 22)
+
+/*
+ * Single-producer, single-consumer ring of bytes received from the server.
+ *
+ * The receiver thread only advances written and the polling thread only
+ * advances read; both count bytes since the start, wrapping around, so that
+ * the ring is empty when they are equal and full when they are VNC_RING_SIZE
+ * apart. A side that runs out of data or space flags itself as waiting before
+ * checking one last time and sleeping on its eventfd, and the other side
+ * signals that eventfd whenever it sees the flag, so neither side makes a
+ * syscall while both are busy.
+ *
+ * Each side stores one value and then loads the other's, which only works if
+ * the store cannot be reordered after the load. SDL_AtomicSet is no more than
+ * an acquire barrier, so flags are raised, and counters moved on, with
+ * read-modify-write operations, which are full barriers.
+ */
+struct VNC_ReceiveRing {
+    Uint8 *data;
+
+    SDL_atomic_t written;
+    SDL_atomic_t read;
+
+    SDL_atomic_t reader_waiting;
+    SDL_atomic_t writer_waiting;
+    int data_ready;
+    int space_ready;
+
+    /* set once the receiver has stopped, after which error is its errno */
+    SDL_atomic_t closed;
+    int error;
+
+    SDL_atomic_t stopping;
+    SDL_Thread *thread;
+};
+
+Uint32 VNC_RingUsed(VNC_ReceiveRing *ring) {
+    return (Uint32) SDL_AtomicGet(&ring->written) -
+        (Uint32) SDL_AtomicGet(&ring->read);
+}
+
+/*
+ * Waits until the given time on the monotonic clock, or indefinitely if 0, for
+ * the receiver thread to put data in the ring, or to stop.
+ *
+ * Returns 1 if there is data or the receiver has stopped, 0 if neither yet,
+ * and -1 on error.
+ */
+int VNC_WaitForRing(VNC_ReceiveRing *ring, Uint64 deadline) {
+    int res = 1;
+
+    SDL_AtomicCAS(&ring->reader_waiting, 0, 1);
+
+    if (!VNC_RingUsed(ring) && !SDL_AtomicGet(&ring->closed)) {
+        res = VNC_WaitForReadable(ring->data_ready, deadline);
+
+        if (res > 0 && VNC_ClearEventFd(ring->data_ready)) {
+            res = -1;
+        }
+    }
+
+    SDL_AtomicSet(&ring->reader_waiting, 0);
+
+    return res;
+}
+
+/*
+ * Takes data out of the ring as recvmsg would from the socket: waiting for it
+ * unless flags include MSG_DONTWAIT, and returning 0 once the receiver has
+ * stopped at the end of the stream.
+ */
+ssize_t VNC_RingRecv(VNC_ReceiveRing *ring, struct iovec *iov, int n,
+        int flags) {
+
+    Uint32 read = SDL_AtomicGet(&ring->read);
+    Uint32 used;
+
+    for (;;) {
+        /* anything written before the receiver stopped is seen with closed */
+        int closed = SDL_AtomicGet(&ring->closed);
+        used = (Uint32) SDL_AtomicGet(&ring->written) - read;
+
+        if (used) {
+            break;
+        }
+
+        if (closed) {
+            errno = ring->error;
+            return ring->error ? -1 : 0;
+        }
+
+        if (flags & MSG_DONTWAIT) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if (VNC_WaitForRing(ring, 0) < 0) {
+            return -1;
+        }
+    }
+
+    size_t copied = 0;
+
+    for (int i = 0; i < n && copied < used; i++) {
+        size_t chunk = SDL_min(iov[i].iov_len, used - copied);
+        size_t offset = (read + copied) & (VNC_RING_SIZE - 1);
+        size_t first = SDL_min(chunk, VNC_RING_SIZE - offset);
+
+        SDL_memcpy(iov[i].iov_base, ring->data + offset, first);
+        SDL_memcpy((Uint8 *) iov[i].iov_base + first, ring->data,
+                chunk - first);
+        copied += chunk;
+    }
+
+    SDL_AtomicAdd(&ring->read, copied);
+
+    if (SDL_AtomicGet(&ring->writer_waiting) &&
+            VNC_SignalEventFd(ring->space_ready)) {
+        return -1;
+    }
+
+    return copied;
+}
+
+/*
+ * Receives data from the server into the given destinations, taking it from
+ * the connection's receive ring instead of the socket when it has one; recv
+ * syscalls are then made, and counted, by its receiver thread.
+ */
+ssize_t VNC_RecvVector(VNC_Connection *vnc, struct iovec *iov, int n,
+        int flags) {
+
+    if (vnc->ring) {
+        ssize_t bytes_read = VNC_RingRecv(vnc->ring, iov, n, flags);
+
+        if (bytes_read > 0) {
+            vnc->stats.bytes_received += bytes_read;
+        }
+
+        return bytes_read;
+    }
+
+    struct msghdr msg;
+    SDL_zero(msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    ssize_t bytes_read = recvmsg(vnc->socket, &msg, flags);
+
+    vnc->stats.recv_ticks += SDL_GetPerformanceCounter() - start;
+    vnc->stats.recv_calls++;
+    if (bytes_read > 0) {
+        vnc->stats.bytes_received += bytes_read;
+    }
+
+    return bytes_read;
+}
+
+ssize_t VNC_Recv(VNC_Connection *vnc, void *buffer, size_t n, int flags) {
+    struct iovec iov = { buffer, n };
+    return VNC_RecvVector(vnc, &iov, 1, flags);
+}
+
+ssize_t VNC_FillReceiveBuffer(VNC_Connection *vnc, int flags) {
+    VNC_ReceiveBuffer *rb = &vnc->recv_buffer;
+
+    if (rb->start == rb->end) {
+        rb->start = 0;
+        rb->end = 0;
+
+    } else if (rb->end == rb->size) {
+        SDL_memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+        rb->end -= rb->start;
+        rb->start = 0;
+    }
+
+    ssize_t bytes_read = VNC_Recv(vnc, rb->data + rb->end,
+            rb->size - rb->end, flags);
+
+    if (bytes_read > 0) {
+        rb->end += bytes_read;
+    }
+
+    return bytes_read;
+}
+
+/*
+ * Reads n bytes from the server into buffer.
+ *
+ * Reads are served from the connection's receive buffer, which is refilled in
+ * large chunks so that small protocol fields do not each cost a syscall. Once
+ * the receive buffer is drained, what is left of a large read is received
+ * directly into its destination instead.
+ */
+int VNC_FromServer(VNC_Connection *vnc, void *buffer, size_t n) {
+    VNC_ReceiveBuffer *rb = &vnc->recv_buffer;
 
     size_t left_to_read = n;
-    char *needle = buffer;
+    Uint8 *needle = buffer;
 
     while (left_to_read > 0) {
-        ssize_t bytes_read = recv(socket, needle, left_to_read, 0);
+        size_t buffered = rb->end - rb->start;
+
+        if (buffered) {
+            size_t chunk = SDL_min(buffered, left_to_read);
+            SDL_memcpy(needle, rb->data + rb->start, chunk);
+
+            rb->start += chunk;
+            left_to_read -= chunk;
+            needle += chunk;
+            continue;
+        }
+
+        ssize_t bytes_read;
+
+        if (left_to_read >= VNC_DIRECT_READ_THRESHOLD) {
+            bytes_read = VNC_Recv(vnc, needle, left_to_read, 0);
+
+            if (bytes_read > 0) {
+                left_to_read -= bytes_read;
+                needle += bytes_read;
+            }
+
+        } else {
+            bytes_read = VNC_FillReceiveBuffer(vnc, 0);
+        }
 
         if (bytes_read < 0) {
             return -1;
@@ -142,61 +575,203 @@ int VNC_FromServer(int socket, void *buffer, size_t n) {
         if (bytes_read == 0) {
             return n - left_to_read;
         }
-
-        left_to_read -= bytes_read;
-        needle += bytes_read;
     }
 
     return n;
 }
 
-int VNC_ServerToBuffer(VNC_Connection *vnc, size_t n) {
-    VNC_AssureBufferSize(vnc->buffer, n);
-    return VNC_FromServer(vnc->socket, vnc->buffer.data, n);
+/*
+ * Makes room in the receive buffer for n bytes from its start, and for more
+ * data to be received after what is already buffered.
+ */
+int VNC_ReserveReceiveBuffer(VNC_ReceiveBuffer *rb, size_t n) {
+    size_t buffered = rb->end - rb->start;
+    size_t size = SDL_max(n, buffered + 1);
+
+    if (rb->start && (rb->size - rb->start < size ||
+                rb->size - rb->end < VNC_DIRECT_READ_THRESHOLD)) {
+        SDL_memmove(rb->data, rb->data + rb->start, buffered);
+        rb->start = 0;
+        rb->end = buffered;
+    }
+
+    if (rb->size < size) {
+        size = SDL_max(size, rb->size * 2);
+
+        Uint8 *data = SDL_realloc(rb->data, size);
+        if (!data) {
+            return -1;
+        }
+
+        rb->data = data;
+        rb->size = size;
+    }
+
+    return 0;
 }
 
-int VNC_AssureScratchBufferSize(VNC_Connection *vnc, size_t w, size_t h) {
-    VNC_ServerDetails details = vnc->server_details;
+/*
+ * Whether the parser is between messages, with nothing of the next one
+ * received yet.
+ */
+SDL_bool VNC_ParserIdle(VNC_Connection *vnc) {
+    VNC_ReceiveBuffer *rb = &vnc->recv_buffer;
 
-    if (vnc->scratch_buffer && vnc->scratch_buffer->w == w &&
-            vnc->scratch_buffer->h == h) {
-        return 0;
+    return vnc->parser->state == VNC_PARSE_MESSAGE_TYPE && rb->start == rb->end;
+}
+
+/*
+ * Waits until the given time on the monotonic clock, or indefinitely if 0, for
+ * more data from the server to become available to receive.
+ *
+ * Returns 1 if there is data to receive, 0 if there is none yet, and -1 on
+ * error.
+ */
+int VNC_WaitForServer(VNC_Connection *vnc, Uint64 deadline) {
+    if (vnc->ring) {
+        return VNC_WaitForRing(vnc->ring, deadline);
     }
 
-    if (vnc->scratch_buffer) {
-        SDL_FreeSurface(vnc->scratch_buffer);
+    return VNC_WaitForReadable(vnc->socket, deadline);
+}
+
+/*
+ * Fails the rectangle being handled for want of memory, rather than as
+ * malformed.
+ */
+int VNC_OutOfMemory(VNC_Connection *vnc) {
+    vnc->parser->error = VNC_ERROR_OOM;
+    return -1;
+}
+
+int VNC_ServerToBuffer(VNC_Connection *vnc, size_t n) {
+    if (VNC_AssureBufferSize(&vnc->buffer, n)) {
+        return VNC_OutOfMemory(vnc);
     }
 
-    vnc->scratch_buffer = SDL_CreateRGBSurface(0, w, h, details.fmt.bpp,
-            details.fmt.red_max << details.fmt.red_shift,
-            details.fmt.green_max << details.fmt.green_shift,
-            details.fmt.blue_max << details.fmt.blue_shift,
-            0);
-    SDL_SetSurfaceBlendMode(vnc->scratch_buffer, SDL_BLENDMODE_NONE);
+    return VNC_FromServer(vnc, vnc->buffer.data, n);
+}
 
-    return 0;
+int VNC_ToServer(int socket, void *data, size_t n) {
+    return send(socket, data, n, 0);
 }
 
-int VNC_ServerToScratchBuffer(VNC_Connection *vnc, size_t w, size_t h) {
-    VNC_AssureScratchBufferSize(vnc, w, h);
+/*
+ * Most data a connection polled by a connection manager may have waiting to be
+ * sent; a server that leaves more than this unread is not reading at all.
+ */
+#define VNC_MAX_OUTBOX (1 << 20)
+
+/*
+ * Data for the server that could not be sent without blocking, while the
+ * connection is polled by a connection manager, whose event loops must not
+ * block on any one connection. It is sent on once the socket is writable.
+ */
+struct VNC_Outbox {
+    SDL_mutex *lock;
+    VNC_ConnectionBuffer buffer;
+    size_t length;
+
+    /* eventfd that wakes the connection's event loop; -1 once it has left */
+    int wake;
+
+    /* epoll events the event loop watches the socket for, kept by the loop */
+    Uint32 events;
+};
+
+VNC_Outbox *VNC_CreateOutbox(void) {
+    VNC_Outbox *outbox = SDL_calloc(1, sizeof (VNC_Outbox));
+
+    if (!outbox) {
+        return NULL;
+    }
 
-    size_t pixel_data_size = w * h * vnc->server_details.fmt.bpp / 8;
+    outbox->lock = SDL_CreateMutex();
+    outbox->wake = -1;
 
-    if (SDL_MUSTLOCK(vnc->scratch_buffer)) {
-        SDL_LockSurface(vnc->scratch_buffer);
+    if (!outbox->lock) {
+        SDL_free(outbox);
+        return NULL;
     }
 
-    VNC_FromServer(vnc->socket, vnc->scratch_buffer->pixels, pixel_data_size);
+    return outbox;
+}
+
+/*
+ * Sends as much of the data waiting in an outbox as the socket takes, or all
+ * of it if flags do not include MSG_DONTWAIT. The outbox must be locked.
+ *
+ * Returns 0 on success, including when some data is left, and -1 on error.
+ */
+int VNC_FlushOutbox(VNC_Outbox *outbox, int socket, int flags) {
+    Uint8 *data = outbox->buffer.data;
+    size_t sent = 0;
+
+    while (sent < outbox->length) {
+        ssize_t res = send(socket, data + sent, outbox->length - sent, flags);
+
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+
+            break;
+        }
+
+        sent += res;
+    }
 
-    if (SDL_MUSTLOCK(vnc->scratch_buffer)) {
-        SDL_UnlockSurface(vnc->scratch_buffer);
+    if (sent) {
+        SDL_memmove(data, data + sent, outbox->length - sent);
+        outbox->length -= sent;
     }
 
     return 0;
 }
 
-int VNC_ToServer(int socket, void *data, size_t n) {
-    return send(socket, data, n, 0);
+/*
+ * Sends a message to the server: straight away from a connection's own polling
+ * thread, and through its outbox while it is polled by a connection manager,
+ * so that an event loop never waits for the server to make room.
+ *
+ * Returns the number of bytes sent or queued, or -1 on error.
+ */
+int VNC_SendToServer(VNC_Connection *vnc, void *data, size_t n) {
+    VNC_Outbox *outbox = vnc->outbox;
+
+    if (!outbox) {
+        return VNC_ToServer(vnc->socket, data, n);
+    }
+
+    SDL_LockMutex(outbox->lock);
+
+    /* what is queued goes first, and blocking once out of the manager */
+    int flags = outbox->wake >= 0 ? MSG_DONTWAIT : 0;
+
+    if (VNC_FlushOutbox(outbox, vnc->socket, flags) ||
+            outbox->length + n > VNC_MAX_OUTBOX ||
+            VNC_AssureBufferSize(&outbox->buffer, outbox->length + n)) {
+        SDL_UnlockMutex(outbox->lock);
+        return -1;
+    }
+
+    SDL_memcpy((Uint8 *) outbox->buffer.data + outbox->length, data, n);
+    outbox->length += n;
+
+    int res = VNC_FlushOutbox(outbox, vnc->socket, flags);
+
+    /* the event loop is to watch for the socket to become writable */
+    if (!res && outbox->length && !(outbox->events & EPOLLOUT)) {
+        res = VNC_SignalEventFd(outbox->wake);
+    }
+
+    SDL_UnlockMutex(outbox->lock);
+
+    return res ? -1 : (int) n;
 }
 
 VNC_RFBProtocolVersion VNC_DeduceRFBProtocolVersion(char *str) {
@@ -232,7 +807,7 @@ char *VNC_RFBVersionString(VNC_RFBProtocolVersion ver) {
 
 VNC_RFBProtocolVersion VNC_ReceiveServerVersion(VNC_Connection *vnc) {
     char protocol_string[12];
-    VNC_FromServer(vnc->socket, protocol_string, 12);
+    VNC_FromServer(vnc, protocol_string, 12);
 
     VNC_RFBProtocolVersion ver = VNC_DeduceRFBProtocolVersion(protocol_string);
 
@@ -270,7 +845,7 @@ int VNC_NegotiateSecurity37(VNC_Connection *vnc) {
 
 int VNC_NegotiateSecurity38(VNC_Connection *vnc) {
     Uint8 security_protocol_count;
-    VNC_FromServer(vnc->socket, &security_protocol_count, 1);
+    VNC_FromServer(vnc, &security_protocol_count, 1);
 
     if (!security_protocol_count) {
         return VNC_ERROR_SERVER_DISCONNECT;
@@ -289,7 +864,7 @@ int VNC_NegotiateSecurity38(VNC_Connection *vnc) {
     VNC_ToServer(vnc->socket, &no_sec, 1);
 
     Uint32 security_handshake_error;
-    VNC_FromServer(vnc->socket, &security_handshake_error, 4);
+    VNC_FromServer(vnc, &security_handshake_error, 4);
 
     if (security_handshake_error) {
         return VNC_ERROR_SECURITY_HANDSHAKE_FAILED;
@@ -352,7 +927,7 @@ int VNC_ServerInitialisation(VNC_Connection *vnc) {
     if (vnc->server_details.name_length) {
 
         vnc->server_details.name = malloc(vnc->server_details.name_length + 1);
-        VNC_FromServer(vnc->socket, vnc->server_details.name,
+        VNC_FromServer(vnc, vnc->server_details.name,
                 vnc->server_details.name_length);
         vnc->server_details.name[vnc->server_details.name_length] = '\0';
 
@@ -387,308 +962,5698 @@ int VNC_ServerInitialisation(VNC_Connection *vnc) {
     return 0;
 }
 
-SDL_Surface *VNC_CreateSurfaceForServer(VNC_ServerDetails *details) {
-    return SDL_CreateRGBSurface(0, details->w, details->h, details->fmt.bpp,
-            details->fmt.red_max << details->fmt.red_shift,
-            details->fmt.green_max << details->fmt.green_shift,
-            details->fmt.blue_max << details->fmt.blue_shift,
-            0);
+/*
+ * Edge length in pixels of the tiles that damage is tracked in. Larger tiles
+ * make tracking cheaper but report more of the surface as changed.
+ */
+#ifndef VNC_DAMAGE_TILE_SIZE
+#define VNC_DAMAGE_TILE_SIZE 16
+#endif
+
+/*
+ * Fixed cost of uploading one more rectangle, such as a texture update call,
+ * as the number of tiles that could be uploaded in its stead. Clean tiles are
+ * reported along with dirty ones wherever that saves a rectangle at no more
+ * than this cost.
+ */
+#define VNC_DAMAGE_RECT_COST 4
+
+/*
+ * Bitmap with one bit per tile of the surface; each row of tiles starts on a
+ * new 64-bit word.
+ */
+typedef struct {
+    int tiles_w;
+    int tiles_h;
+    int words;
+    Uint64 *bits;
+} VNC_TileMap;
+
+struct VNC_Damage {
+    SDL_mutex *lock;
+
+    /* damage of the framebuffer update being decoded; polling thread only */
+    VNC_TileMap pending;
+    SDL_bool any_pending;
+
+    /* damage of finished framebuffer updates, guarded by lock */
+    VNC_TileMap done;
+    int w;
+    int h;
+
+    /* scratch space for VNC_TakeDamage, guarded by lock */
+    SDL_Rect *rects;
+    int *open;
+};
+
+int VNC_ResizeTileMap(VNC_TileMap *map, int w, int h) {
+    int tiles_w = (w + VNC_DAMAGE_TILE_SIZE - 1) / VNC_DAMAGE_TILE_SIZE;
+    int tiles_h = (h + VNC_DAMAGE_TILE_SIZE - 1) / VNC_DAMAGE_TILE_SIZE;
+    int words = (tiles_w + 63) / 64;
+
+    Uint64 *bits = SDL_calloc((size_t) words * tiles_h + 1, sizeof (Uint64));
+    if (!bits) {
+        return -1;
+    }
+
+    SDL_free(map->bits);
+
+    map->tiles_w = tiles_w;
+    map->tiles_h = tiles_h;
+    map->words = words;
+    map->bits = bits;
+
+    return 0;
+}
+
+void VNC_ClearTileMap(VNC_TileMap *map) {
+    SDL_memset(map->bits, 0,
+            (size_t) map->words * map->tiles_h * sizeof (Uint64));
+}
+
+/*
+ * Marks the tiles in columns x0 to x1 and rows y0 to y1, exclusive, as dirty,
+ * a whole word of tiles at a time.
+ */
+void VNC_MarkTiles(VNC_TileMap *map, int x0, int y0, int x1, int y1) {
+    int first = x0 / 64;
+    int last = (x1 - 1) / 64;
+
+    Uint64 first_mask = ~(Uint64) 0 << (x0 % 64);
+    Uint64 last_mask = ~(Uint64) 0 >> (63 - (x1 - 1) % 64);
+
+    for (int y = y0; y < y1; y++) {
+        Uint64 *row = map->bits + (size_t) y * map->words;
+
+        if (first == last) {
+            row[first] |= first_mask & last_mask;
+            continue;
+        }
+
+        row[first] |= first_mask;
+
+        for (int w = first + 1; w < last; w++) {
+            row[w] = ~(Uint64) 0;
+        }
+
+        row[last] |= last_mask;
+    }
+}
+
+/*
+ * Finds the first tile at or after x in a row whose bit equals set; returns
+ * the number of tiles in the row's words if there is none.
+ */
+int VNC_NextTile(VNC_TileMap *map, Uint64 *row, int x, SDL_bool set) {
+    int w = x / 64;
+
+    if (w >= map->words) {
+        return map->words * 64;
+    }
+
+    Uint64 flip = set ? 0 : ~(Uint64) 0;
+    Uint64 v = (row[w] ^ flip) & (~(Uint64) 0 << (x % 64));
+
+    while (!v) {
+        if (++w == map->words) {
+            return map->words * 64;
+        }
+
+        v = row[w] ^ flip;
+    }
+
+    return w * 64 + __builtin_ctzll(v);
+}
+
+VNC_Damage *VNC_CreateDamage(void) {
+    VNC_Damage *damage = SDL_calloc(1, sizeof (VNC_Damage));
+
+    if (!damage) {
+        return NULL;
+    }
+
+    damage->lock = SDL_CreateMutex();
+    if (!damage->lock) {
+        SDL_free(damage);
+        return NULL;
+    }
+
+    return damage;
+}
+
+/*
+ * Records that a region of the surface is being changed by the framebuffer
+ * update being decoded.
+ */
+void VNC_AddDamage(VNC_Connection *vnc, SDL_Rect *r) {
+    SDL_Rect clipped;
+    SDL_Rect bounds = { 0, 0, vnc->surface->w, vnc->surface->h };
+
+    if (!SDL_IntersectRect(r, &bounds, &clipped)) {
+        return;
+    }
+
+    VNC_MarkTiles(&vnc->damage->pending,
+            clipped.x / VNC_DAMAGE_TILE_SIZE,
+            clipped.y / VNC_DAMAGE_TILE_SIZE,
+            (clipped.x + clipped.w - 1) / VNC_DAMAGE_TILE_SIZE + 1,
+            (clipped.y + clipped.h - 1) / VNC_DAMAGE_TILE_SIZE + 1);
+
+    vnc->damage->any_pending = SDL_TRUE;
+}
+
+/*
+ * Converts the dirty tiles of a map into rectangles, in units of tiles, and
+ * returns how many there are.
+ *
+ * Each row is split into runs of dirty tiles, joining runs separated by gaps
+ * narrow enough to be worth uploading. A run then extends a rectangle from the
+ * row above if that overdraws little enough, so areas changed together come
+ * out as one rectangle; this takes time linear in the number of tiles.
+ */
+int VNC_TileMapToRects(VNC_TileMap *map, SDL_Rect *rects, int *open) {
+    int count = 0;
+
+    /* rectangles that reach the row above, by index, from left to right */
+    int *above = open;
+    int *below = open + map->tiles_w / 2 + 1;
+    int n_above = 0;
+
+    for (int y = 0; y < map->tiles_h; y++) {
+        Uint64 *row = map->bits + (size_t) y * map->words;
+        int n_below = 0;
+        int a = 0;
+
+        int x0 = VNC_NextTile(map, row, 0, SDL_TRUE);
+
+        while (x0 < map->tiles_w) {
+            int x1 = VNC_NextTile(map, row, x0, SDL_FALSE);
+            int next = VNC_NextTile(map, row, x1, SDL_TRUE);
+
+            while (next < map->tiles_w && next - x1 <= VNC_DAMAGE_RECT_COST) {
+                x1 = VNC_NextTile(map, row, next, SDL_FALSE);
+                next = VNC_NextTile(map, row, x1, SDL_TRUE);
+            }
+
+            /* skip rectangles above that end before this run starts */
+            while (a < n_above &&
+                    rects[above[a]].x + rects[above[a]].w <= x0) {
+                a++;
+            }
+
+            SDL_Rect *r = NULL;
+
+            if (a < n_above && rects[above[a]].x < x1) {
+                SDL_Rect *candidate = &rects[above[a]];
+
+                int ux0 = SDL_min(candidate->x, x0);
+                int ux1 = SDL_max(candidate->x + candidate->w, x1);
+                int waste = (ux1 - ux0) * (candidate->h + 1) -
+                    candidate->w * candidate->h - (x1 - x0);
+
+                if (waste <= VNC_DAMAGE_RECT_COST) {
+                    r = candidate;
+                    r->x = ux0;
+                    r->w = ux1 - ux0;
+                    r->h++;
+                    below[n_below++] = above[a];
+                    a++;
+                }
+            }
+
+            if (!r) {
+                rects[count].x = x0;
+                rects[count].y = y;
+                rects[count].w = x1 - x0;
+                rects[count].h = 1;
+                below[n_below++] = count++;
+            }
+
+            x0 = next;
+        }
+
+        int *swap = above;
+        above = below;
+        below = swap;
+        n_above = n_below;
+    }
+
+    return count;
+}
+
+
+SDL_bool VNC_TileMapsMatch(VNC_TileMap *a, VNC_TileMap *b) {
+    return a->tiles_w == b->tiles_w && a->tiles_h == b->tiles_h;
+}
+
+void VNC_FillTileMap(VNC_TileMap *map) {
+    if (map->tiles_w && map->tiles_h) {
+        VNC_MarkTiles(map, 0, 0, map->tiles_w, map->tiles_h);
+    }
+}
+
+/*
+ * Adds the dirty tiles of src to dst; if the two cover surfaces of different
+ * sizes, all of dst is marked dirty instead.
+ */
+void VNC_MergeTileMap(VNC_TileMap *dst, VNC_TileMap *src) {
+    if (!VNC_TileMapsMatch(dst, src)) {
+        VNC_FillTileMap(dst);
+        return;
+    }
+
+    size_t n = (size_t) dst->words * dst->tiles_h;
+
+    for (size_t i = 0; i < n; i++) {
+        dst->bits[i] |= src->bits[i];
+    }
+}
+
+int VNC_CopyTileMap(VNC_TileMap *dst, VNC_TileMap *src) {
+    if (!VNC_TileMapsMatch(dst, src) || !dst->bits) {
+        if (VNC_ResizeTileMap(dst, src->tiles_w * VNC_DAMAGE_TILE_SIZE,
+                    src->tiles_h * VNC_DAMAGE_TILE_SIZE)) {
+            return -1;
+        }
+    }
+
+    SDL_memcpy(dst->bits, src->bits,
+            (size_t) dst->words * dst->tiles_h * sizeof (Uint64));
+
+    return 0;
+}
+
+/*
+ * Allocates the scratch space VNC_TileMapToRects needs for a map.
+ */
+int VNC_AllocRectScratch(VNC_TileMap *map, SDL_Rect **rects, int **open) {
+    SDL_free(*rects);
+    SDL_free(*open);
+
+    /* a row of n tiles has at most n / 2 + 1 runs of dirty tiles */
+    size_t max_runs = (size_t) map->tiles_w / 2 + 1;
+    *rects = SDL_malloc(max_runs * map->tiles_h * sizeof (SDL_Rect));
+    *open = SDL_malloc(2 * max_runs * sizeof (int));
+
+    return !*rects || !*open;
+}
+
+/*
+ * Converts the dirty tiles of a map into at most max rectangles of a w by h
+ * surface, and clears the map.
+ */
+int VNC_TakeTileMap(VNC_TileMap *map, SDL_Rect *scratch, int *open, int w,
+        int h, SDL_Rect *rects, int max) {
+
+    if (!map->bits) {
+        return 0;
+    }
+
+    int count = VNC_TileMapToRects(map, scratch, open);
+    VNC_ClearTileMap(map);
+
+    /*
+     * If the caller has room for fewer rectangles, merge runs of consecutive
+     * ones; they were found in scanline order, so tend to lie close together.
+     */
+    max = SDL_max(max, 1);
+    int group = (count + max - 1) / max;
+    int n = 0;
+
+    for (int i = 0; i < count; i += group) {
+        SDL_Rect merged = scratch[i];
+
+        for (int j = i + 1; j < i + group && j < count; j++) {
+            SDL_UnionRect(&merged, &scratch[j], &merged);
+        }
+
+        SDL_Rect bounds = { 0, 0, w, h };
+        SDL_Rect pixels = {
+            merged.x * VNC_DAMAGE_TILE_SIZE,
+            merged.y * VNC_DAMAGE_TILE_SIZE,
+            merged.w * VNC_DAMAGE_TILE_SIZE,
+            merged.h * VNC_DAMAGE_TILE_SIZE
+        };
+
+        SDL_IntersectRect(&pixels, &bounds, &rects[n++]);
+    }
+
+    return n;
+}
+
+/*
+ * Flag set on the index of the slot shared between the two threads of a triple
+ * buffer while it holds a frame that the renderer has yet to acquire.
+ */
+#define VNC_FRAME_FRESH 4
+
+typedef struct {
+    SDL_Surface *surface;
+
+    /* regions in which this frame lags the newest one; polling thread only */
+    VNC_TileMap stale;
+
+    /* regions changed since the frame published before this one reached the
+     * renderer */
+    VNC_TileMap delivered;
+} VNC_FrameSlot;
+
+struct VNC_FrameBuffers {
+    VNC_FrameSlot slots[3];
+
+    /* index of the slot between the threads, with VNC_FRAME_FRESH if new */
+    SDL_atomic_t middle;
+
+    int back;  /* written to by the polling thread */
+    int front; /* read from by the renderer */
+
+    /* renderer only: damage not yet taken with VNC_TakeDamage */
+    VNC_TileMap taken;
+    SDL_Rect *rects;
+    int *open;
+    int w;
+    int h;
+};
+
+SDL_bool VNC_SurfacesMatch(SDL_Surface *a, SDL_Surface *b) {
+    return a->w == b->w && a->h == b->h &&
+        a->format->format == b->format->format;
+}
+
+int VNC_ResizeFrameSlot(VNC_FrameSlot *slot) {
+    int w = slot->surface->w;
+    int h = slot->surface->h;
+
+    return VNC_ResizeTileMap(&slot->stale, w, h) |
+        VNC_ResizeTileMap(&slot->delivered, w, h);
+}
+
+void VNC_FreeFrameSlot(VNC_FrameSlot *slot) {
+    SDL_FreeSurface(slot->surface);
+    SDL_free(slot->stale.bits);
+    SDL_free(slot->delivered.bits);
+}
+
+/*
+ * Copies the tiles marked in a map from one surface to another of the same
+ * size and format.
+ */
+void VNC_CopyTiles(VNC_TileMap *map, SDL_Surface *src, SDL_Surface *dst) {
+    uint bytes_pp = src->format->BytesPerPixel;
+
+    for (int ty = 0; ty < map->tiles_h; ty++) {
+        Uint64 *row = map->bits + (size_t) ty * map->words;
+
+        int y0 = ty * VNC_DAMAGE_TILE_SIZE;
+        int y1 = SDL_min(y0 + VNC_DAMAGE_TILE_SIZE, src->h);
+
+        int x0 = VNC_NextTile(map, row, 0, SDL_TRUE);
+
+        while (x0 < map->tiles_w) {
+            int x1 = VNC_NextTile(map, row, x0, SDL_FALSE);
+
+            int from = x0 * VNC_DAMAGE_TILE_SIZE;
+            int to = SDL_min(x1 * VNC_DAMAGE_TILE_SIZE, src->w);
+            size_t n = (to - from) * bytes_pp;
+
+            for (int y = y0; y < y1; y++) {
+                SDL_memcpy(
+                        (Uint8 *) dst->pixels + y * dst->pitch +
+                            from * bytes_pp,
+                        (Uint8 *) src->pixels + y * src->pitch +
+                            from * bytes_pp,
+                        n);
+            }
+
+            x0 = VNC_NextTile(map, row, x1, SDL_TRUE);
+        }
+    }
+}
+
+/*
+ * Hands the back buffer, now holding a complete framebuffer update, over to
+ * the renderer, and takes another buffer to decode the next update into.
+ *
+ * The buffer taken in exchange lags behind by the damage of every update
+ * published since it was last the back buffer; just those regions are copied
+ * over from the frame just published; if it is of another size or format, it
+ * is replaced, keeping the old buffer should that fail.
+ */
+int VNC_PublishFrame(VNC_Connection *vnc) {
+    VNC_FrameBuffers *fb = vnc->frames;
+    VNC_TileMap *damage = &vnc->damage->pending;
+    VNC_FrameSlot *published = &fb->slots[fb->back];
+
+    for (int i = 0; i < 3; i++) {
+        if (i != fb->back) {
+            VNC_MergeTileMap(&fb->slots[i].stale, damage);
+        }
+    }
+
+    int middle;
+
+    do {
+        middle = SDL_AtomicGet(&fb->middle);
+        VNC_CopyTileMap(&published->delivered, damage);
+
+        /*
+         * The frame about to be replaced never reached the renderer, so its
+         * changes have to be passed on with this one.
+         */
+        if (middle & VNC_FRAME_FRESH) {
+            VNC_MergeTileMap(&published->delivered,
+                    &fb->slots[middle & 3].delivered);
+        }
+    } while (!SDL_AtomicCAS(&fb->middle, middle, fb->back | VNC_FRAME_FRESH));
+
+    fb->back = middle & 3;
+    VNC_FrameSlot *back = &fb->slots[fb->back];
+
+    if (!VNC_SurfacesMatch(back->surface, published->surface)) {
+        VNC_FrameSlot resized;
+        SDL_zero(resized);
+
+        resized.surface = SDL_CreateRGBSurfaceWithFormat(0,
+                published->surface->w, published->surface->h, 32,
+                published->surface->format->format);
+
+        if (!resized.surface || VNC_ResizeFrameSlot(&resized)) {
+            VNC_FreeFrameSlot(&resized);
+            return -1;
+        }
+
+        VNC_FreeFrameSlot(back);
+        *back = resized;
+        VNC_FillTileMap(&back->stale);
+    }
+
+    VNC_CopyTiles(&back->stale, published->surface, back->surface);
+    VNC_ClearTileMap(&back->stale);
+
+    vnc->surface = back->surface;
+
+    return 0;
+}
+
+/*
+ * Frees triple buffers that were never put to use, all but the surface of the
+ * first slot, which is still the connection's surface.
+ */
+void VNC_DestroyFrameBuffers(VNC_FrameBuffers *fb) {
+    fb->slots[0].surface = NULL;
+
+    for (int i = 0; i < 3; i++) {
+        VNC_FreeFrameSlot(&fb->slots[i]);
+    }
+
+    SDL_free(fb->taken.bits);
+    SDL_free(fb->rects);
+    SDL_free(fb->open);
+    SDL_free(fb);
+}
+
+int VNC_EnableTripleBuffering(VNC_Connection *vnc) {
+    if (vnc->thread || vnc->manager) {
+        return VNC_ERROR_ALREADY_STARTED;
+    }
+
+    if (vnc->frames) {
+        return 0;
+    }
+
+    VNC_FrameBuffers *fb = SDL_calloc(1, sizeof (VNC_FrameBuffers));
+    if (!fb) {
+        return VNC_ERROR_OOM;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        fb->slots[i].surface = i ? SDL_ConvertSurfaceFormat(vnc->surface,
+                vnc->surface->format->format, 0) : vnc->surface;
+
+        if (!fb->slots[i].surface || VNC_ResizeFrameSlot(&fb->slots[i])) {
+            VNC_DestroyFrameBuffers(fb);
+            return VNC_ERROR_OOM;
+        }
+    }
+
+    fb->back = 0;
+    SDL_AtomicSet(&fb->middle, 1);
+    fb->front = 2;
+
+    fb->w = vnc->surface->w;
+    fb->h = vnc->surface->h;
+
+    if (VNC_ResizeTileMap(&fb->taken, fb->w, fb->h) ||
+            VNC_AllocRectScratch(&fb->taken, &fb->rects, &fb->open)) {
+        VNC_DestroyFrameBuffers(fb);
+        return VNC_ERROR_OOM;
+    }
+
+    VNC_FillTileMap(&fb->taken);
+    vnc->frames = fb;
+
+    return 0;
+}
+
+SDL_Surface *VNC_AcquireFrame(VNC_Connection *vnc) {
+    VNC_FrameBuffers *fb = vnc->frames;
+
+    SDL_AtomicSet(&vnc->frame_ready, 0);
+
+    if (!fb) {
+        return vnc->surface;
+    }
+
+    if (SDL_AtomicGet(&fb->middle) & VNC_FRAME_FRESH) {
+        fb->front = SDL_AtomicSet(&fb->middle, fb->front) & 3;
+        VNC_FrameSlot *front = &fb->slots[fb->front];
+
+        if (front->surface->w != fb->w || front->surface->h != fb->h) {
+            fb->w = front->surface->w;
+            fb->h = front->surface->h;
+
+            if (VNC_ResizeTileMap(&fb->taken, fb->w, fb->h) ||
+                    VNC_AllocRectScratch(&fb->taken, &fb->rects, &fb->open)) {
+                fb->w = 0;
+                fb->h = 0;
+            }
+        }
+
+        VNC_MergeTileMap(&fb->taken, &front->delivered);
+    }
+
+    return fb->slots[fb->front].surface;
+}
+
+/*
+ * Forgets any damage recorded so far and damages the whole surface instead,
+ * for when the surface is replaced.
+ */
+int VNC_DamageSurface(VNC_Connection *vnc) {
+    VNC_Damage *damage = vnc->damage;
+    int w = vnc->surface->w;
+    int h = vnc->surface->h;
+    int res = 0;
+
+    SDL_LockMutex(damage->lock);
+
+    res |= VNC_ResizeTileMap(&damage->done, w, h);
+    res |= VNC_AllocRectScratch(&damage->done, &damage->rects, &damage->open);
+    damage->w = w;
+    damage->h = h;
+
+    SDL_UnlockMutex(damage->lock);
+
+    res |= VNC_ResizeTileMap(&damage->pending, w, h);
+
+    if (res) {
+        return -1;
+    }
+
+    VNC_FillTileMap(&damage->pending);
+    damage->any_pending = SDL_TRUE;
+
+    return 0;
+}
+
+/*
+ * Replaces the surface that framebuffer updates are decoded into, damaging all
+ * of it.
+ */
+int VNC_ReplaceSurface(VNC_Connection *vnc, SDL_Surface *surface) {
+    if (!surface) {
+        return -1;
+    }
+
+    SDL_FreeSurface(vnc->surface);
+    vnc->surface = surface;
+
+    if (vnc->frames) {
+        VNC_FrameSlot *back = &vnc->frames->slots[vnc->frames->back];
+        back->surface = surface;
+
+        if (VNC_ResizeFrameSlot(back)) {
+            return -1;
+        }
+    }
+
+    return VNC_DamageSurface(vnc);
+}
+
+/*
+ * Tells the application that a new frame can be acquired, unless it has
+ * already been told and has not acquired a frame since.
+ *
+ * The flag is raised only after the frame is published and lowered before a
+ * frame is acquired, so a frame published while an event is pending is
+ * picked up by the acquisition that event leads to.
+ */
+void VNC_NotifyFrameReady(VNC_Connection *vnc) {
+    if (!SDL_AtomicCAS(&vnc->frame_ready, 0, 1)) {
+        return;
+    }
+
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = VNC_FRAME_READY;
+    event.user.data1 = vnc;
+
+    if (SDL_PushEvent(&event) != 1) {
+        SDL_AtomicSet(&vnc->frame_ready, 0);
+    }
+}
+
+/*
+ * Makes the damage of a fully decoded framebuffer update available to
+ * VNC_TakeDamage, and the update itself to VNC_AcquireFrame.
+ */
+int VNC_PublishDamage(VNC_Connection *vnc) {
+    VNC_Damage *damage = vnc->damage;
+
+    if (!damage->any_pending) {
+        return 0;
+    }
+
+    if (vnc->frames) {
+        if (VNC_PublishFrame(vnc)) {
+            return -1;
+        }
+
+    } else {
+        SDL_LockMutex(damage->lock);
+        VNC_MergeTileMap(&damage->done, &damage->pending);
+        SDL_UnlockMutex(damage->lock);
+    }
+
+    VNC_ClearTileMap(&damage->pending);
+    damage->any_pending = SDL_FALSE;
+
+    VNC_NotifyFrameReady(vnc);
+
+    return 0;
+}
+
+int VNC_TakeDamage(VNC_Connection *vnc, SDL_Rect *rects, int max) {
+    VNC_FrameBuffers *fb = vnc->frames;
+
+    if (fb) {
+        return VNC_TakeTileMap(&fb->taken, fb->rects, fb->open, fb->w, fb->h,
+                rects, max);
+    }
+
+    VNC_Damage *damage = vnc->damage;
+
+    SDL_LockMutex(damage->lock);
+    int n = VNC_TakeTileMap(&damage->done, damage->rects, damage->open,
+            damage->w, damage->h, rects, max);
+    SDL_UnlockMutex(damage->lock);
+
+    return n;
+}
+
+SDL_Surface *VNC_CreateSurfaceForConnection(VNC_Connection *vnc) {
+    return SDL_CreateRGBSurfaceWithFormat(0, vnc->server_details.w,
+            vnc->server_details.h, 32, vnc->pixel_format);
+}
+
+/*
+ * Pixel format of the connection's surface unless told otherwise: 32-bit XRGB,
+ * which most renderers and window surfaces use natively.
+ */
+#define VNC_DEFAULT_PIXEL_FORMAT SDL_PIXELFORMAT_RGB888
+
+/*
+ * Framebuffer updates that transfer fewer bytes than this are dominated by
+ * latency rather than throughput, and are not used to estimate the latter.
+ */
+#define VNC_THROUGHPUT_MIN_SAMPLE (16 * 1024)
+
+/*
+ * Throughput in bytes per second below which the server is asked for 8 and 16
+ * bits per pixel respectively; roughly 1 and 10 Mbit/s.
+ */
+#define VNC_COLOR_LOW_THROUGHPUT (128 * 1024)
+#define VNC_COLOR_MEDIUM_THROUGHPUT (1280 * 1024)
+
+/*
+ * Factor by which throughput has to exceed the threshold it fell below before
+ * the color depth is raised again, so that a connection hovering around a
+ * threshold does not keep switching back and forth.
+ */
+#define VNC_COLOR_HYSTERESIS 2
+
+int VNC_PixelFormatFromSDL(Uint32 format, VNC_PixelFormat *fmt) {
+    int bpp;
+    Uint32 r, g, b, a;
+
+    if (SDL_ISPIXELFORMAT_FOURCC(format) ||
+            !SDL_PixelFormatEnumToMasks(format, &bpp, &r, &g, &b, &a)) {
+        return -1;
+    }
+
+    if ((bpp != 8 && bpp != 16 && bpp != 32) || !r || !g || !b) {
+        return -1;
+    }
+
+    fmt->bpp = bpp;
+    /* the depth counts only color bits, so 8:8:8 in 32 bpp is depth 24 */
+    fmt->depth = __builtin_popcount(r | g | b);
+    fmt->is_big_endian = SDL_BYTEORDER == SDL_BIG_ENDIAN;
+    fmt->is_true_color = 1;
+
+    fmt->red_shift = __builtin_ctz(r);
+    fmt->green_shift = __builtin_ctz(g);
+    fmt->blue_shift = __builtin_ctz(b);
+
+    fmt->red_max = r >> fmt->red_shift;
+    fmt->green_max = g >> fmt->green_shift;
+    fmt->blue_max = b >> fmt->blue_shift;
+
+    return 0;
+}
+
+int VNC_PixelFormatForLevel(Uint32 format, VNC_ColorLevel level,
+        VNC_PixelFormat *fmt) {
+
+    switch (level) {
+        case VNC_COLOR_LOW:
+            fmt->bpp = 8;
+            fmt->depth = 8;
+            fmt->is_big_endian = 0;
+            fmt->is_true_color = 1;
+            fmt->red_max = 7;
+            fmt->green_max = 7;
+            fmt->blue_max = 3;
+            fmt->red_shift = 0;
+            fmt->green_shift = 3;
+            fmt->blue_shift = 6;
+            return 0;
+
+        case VNC_COLOR_MEDIUM:
+            return VNC_PixelFormatFromSDL(SDL_PIXELFORMAT_RGB565, fmt);
+
+        default:
+            return VNC_PixelFormatFromSDL(format, fmt);
+    }
+}
+
+Uint8 VNC_ScaleColorComponent(Uint32 value, Uint32 max) {
+    return (value * 255 + max / 2) / max;
+}
+
+/*
+ * Builds a table mapping every pixel value of an 8 or 16 bits per pixel format
+ * to the corresponding pixel value in the given SDL pixel format.
+ */
+Uint32 *VNC_CreatePixelLUT(VNC_PixelFormat *fmt, Uint32 format) {
+    SDL_PixelFormat *dst = SDL_AllocFormat(format);
+    size_t n = (size_t) 1 << fmt->bpp;
+    Uint32 *lut = SDL_malloc(n * sizeof (Uint32));
+
+    if (!dst || !lut) {
+        SDL_FreeFormat(dst);
+        SDL_free(lut);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        lut[i] = SDL_MapRGB(dst,
+                VNC_ScaleColorComponent(i >> fmt->red_shift & fmt->red_max,
+                    fmt->red_max),
+                VNC_ScaleColorComponent(i >> fmt->green_shift & fmt->green_max,
+                    fmt->green_max),
+                VNC_ScaleColorComponent(i >> fmt->blue_shift & fmt->blue_max,
+                    fmt->blue_max));
+    }
+
+    SDL_FreeFormat(dst);
+
+    return lut;
+}
+
+int VNC_SendSetPixelFormat(VNC_Connection *vnc, VNC_PixelFormat *fmt) {
+    Uint8 msg[20];
+    SDL_zero(msg);
+
+    msg[0] = 0; // ID of SetPixelFormat message
+    msg[4] = fmt->bpp;
+    msg[5] = fmt->depth;
+    msg[6] = fmt->is_big_endian;
+    msg[7] = fmt->is_true_color;
+
+    Uint16 *maxima = (Uint16 *) &msg[8];
+    maxima[0] = SDL_SwapBE16(fmt->red_max);
+    maxima[1] = SDL_SwapBE16(fmt->green_max);
+    maxima[2] = SDL_SwapBE16(fmt->blue_max);
+
+    msg[14] = fmt->red_shift;
+    msg[15] = fmt->green_shift;
+    msg[16] = fmt->blue_shift;
+
+    return VNC_SendToServer(vnc, msg, sizeof (msg));
+}
+
+/*
+ * Flags of Fence messages; the server is asked to respond to a fence only if
+ * it has the request flag set.
+ */
+#define VNC_FENCE_BLOCK_BEFORE (1u << 0)
+#define VNC_FENCE_BLOCK_AFTER (1u << 1)
+#define VNC_FENCE_SYNC_NEXT (1u << 2)
+#define VNC_FENCE_REQUEST (1u << 31)
+#define VNC_FENCE_FLAGS \
+    (VNC_FENCE_BLOCK_BEFORE | VNC_FENCE_BLOCK_AFTER | VNC_FENCE_SYNC_NEXT)
+
+#define VNC_FENCE_MAX_PAYLOAD 64
+
+/*
+ * Payload of the fences sent ahead of a SetPixelFormat message, which tell
+ * where in the stream of updates the server switched pixel formats.
+ */
+#define VNC_FENCE_PIXEL_FORMAT 'P'
+
+int VNC_SendFence(VNC_Connection *vnc, Uint32 flags, Uint8 *payload,
+        Uint8 length) {
+
+    Uint8 msg[9 + VNC_FENCE_MAX_PAYLOAD];
+    SDL_zero(msg);
+
+    msg[0] = 248; // ID of Fence message
+
+    Uint32 flags_be = SDL_SwapBE32(flags);
+    SDL_memcpy(&msg[4], &flags_be, 4);
+
+    msg[8] = length;
+    SDL_memcpy(&msg[9], payload, length);
+
+    return VNC_SendToServer(vnc, msg, 9 + length);
+}
+
+int VNC_SendEnableContinuousUpdates(VNC_Connection *vnc, SDL_bool enable) {
+    Uint8 msg[10];
+    Uint16 area[4] = {
+        0,
+        0,
+        SDL_SwapBE16(vnc->server_details.w),
+        SDL_SwapBE16(vnc->server_details.h)
+    };
+
+    msg[0] = 150; // ID of EnableContinuousUpdates message
+    msg[1] = enable;
+    SDL_memcpy(&msg[2], area, sizeof (area));
+
+    return VNC_SendToServer(vnc, msg, sizeof (msg));
+}
+
+/*
+ * Sets up conversion of pixel data sent by the server in the given format into
+ * the connection's surface.
+ */
+int VNC_UseServerPixelFormat(VNC_Connection *vnc, VNC_PixelFormat *fmt) {
+    vnc->server_details.fmt = *fmt;
+
+    SDL_free(vnc->pixel_lut);
+    vnc->pixel_lut = NULL;
+
+    if (vnc->color_level != VNC_COLOR_FULL) {
+        vnc->pixel_lut = VNC_CreatePixelLUT(fmt, vnc->pixel_format);
+
+        if (!vnc->pixel_lut) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Asks the server to send pixel data at the connection's current color level,
+ * and sets up conversion of that data into the connection's surface.
+ *
+ * Must only be called when no framebuffer update is in flight and no decode
+ * job is outstanding, as both may still be using the old format.
+ */
+int VNC_ApplyColorLevel(VNC_Connection *vnc) {
+    VNC_PixelFormat fmt;
+
+    if (VNC_PixelFormatForLevel(vnc->pixel_format, vnc->color_level, &fmt)) {
+        return -1;
+    }
+
+    if (VNC_SendSetPixelFormat(vnc, &fmt) < 0) {
+        return -1;
+    }
+
+    return VNC_UseServerPixelFormat(vnc, &fmt);
+}
+
+/*
+ * Converts the connection's surface to the given SDL pixel format.
+ */
+int VNC_ConvertSurface(VNC_Connection *vnc, Uint32 format) {
+    vnc->pixel_format = format;
+
+    if (vnc->surface) {
+        if (VNC_ReplaceSurface(vnc,
+                    SDL_ConvertSurfaceFormat(vnc->surface, format, 0))) {
+            return -1;
+        }
+
+        return VNC_PublishDamage(vnc);
+    }
+
+    return 0;
+}
+
+int VNC_ApplyPixelFormat(VNC_Connection *vnc, Uint32 format) {
+    if (VNC_ConvertSurface(vnc, format)) {
+        return -1;
+    }
+
+    return VNC_ApplyColorLevel(vnc);
+}
+
+/*
+ * Asks the server for pixel data in a new format while continuous updates are
+ * enabled, when updates in the old format may already be on their way.
+ *
+ * The SetPixelFormat message is preceded by a fence that the server answers
+ * right before it switches formats, so the switch is made on this side once
+ * the answer arrives; see VNC_FinishPixelFormatSync.
+ */
+int VNC_StartPixelFormatSync(VNC_Connection *vnc, Uint32 format,
+        VNC_ColorLevel level) {
+
+    VNC_PixelFormat fmt;
+    Uint8 payload = VNC_FENCE_PIXEL_FORMAT;
+
+    if (VNC_PixelFormatForLevel(format, level, &fmt)) {
+        return -1;
+    }
+
+    if (VNC_SendFence(vnc, VNC_FENCE_REQUEST | VNC_FENCE_SYNC_NEXT,
+                &payload, 1) < 0 || VNC_SendSetPixelFormat(vnc, &fmt) < 0) {
+        return -1;
+    }
+
+    vnc->sync_pixel_format = format;
+    vnc->sync_color_level = level;
+    vnc->syncing_pixel_format = SDL_TRUE;
+
+    return 0;
+}
+
+/*
+ * Switches to the pixel format asked for by VNC_StartPixelFormatSync, once the
+ * server has answered the fence sent with it.
+ *
+ * Returns 1 if the color depth was raised, as the whole framebuffer then needs
+ * requesting again, 0 otherwise, and -1 on error.
+ */
+int VNC_FinishPixelFormatSync(VNC_Connection *vnc) {
+    VNC_PixelFormat fmt;
+    Uint8 depth = vnc->server_details.fmt.depth;
+
+    vnc->syncing_pixel_format = SDL_FALSE;
+    vnc->color_level = vnc->sync_color_level;
+
+    if (vnc->sync_pixel_format != vnc->pixel_format &&
+            VNC_ConvertSurface(vnc, vnc->sync_pixel_format)) {
+        return -1;
+    }
+
+    if (VNC_PixelFormatForLevel(vnc->pixel_format, vnc->color_level, &fmt) ||
+            VNC_UseServerPixelFormat(vnc, &fmt)) {
+        return -1;
+    }
+
+    return vnc->server_details.fmt.depth > depth;
+}
+
+/*
+ * Folds the number of bytes a framebuffer update took to receive, and the time
+ * in nanoseconds between the first and the last of them arriving, into the
+ * connection's throughput estimate.
+ */
+void VNC_SampleThroughput(VNC_Connection *vnc, Uint64 bytes, Uint64 ns) {
+    if (bytes < VNC_THROUGHPUT_MIN_SAMPLE) {
+        return;
+    }
+
+    /*
+     * If the whole update was already waiting in the socket buffer, the link
+     * was not the bottleneck; count it as comfortably fast.
+     */
+    double rate = VNC_COLOR_MEDIUM_THROUGHPUT * VNC_COLOR_HYSTERESIS * 4.0;
+
+    if (ns) {
+        rate = SDL_min(rate, (double) bytes * VNC_NS_PER_SECOND / ns);
+    }
+
+    if (vnc->stats.throughput) {
+        vnc->stats.throughput = 0.75 * vnc->stats.throughput + 0.25 * rate;
+    } else {
+        vnc->stats.throughput = rate;
+    }
+}
+
+VNC_ColorLevel VNC_ChooseColorLevel(VNC_Connection *vnc) {
+    double throughput = vnc->stats.throughput;
+    VNC_ColorLevel level = vnc->color_level;
+
+    if (!throughput) {
+        return level;
+    }
+
+    if (throughput < VNC_COLOR_LOW_THROUGHPUT) {
+        return VNC_COLOR_LOW;
+    }
+
+    if (throughput < VNC_COLOR_MEDIUM_THROUGHPUT) {
+        if (level == VNC_COLOR_LOW && throughput >=
+                VNC_COLOR_LOW_THROUGHPUT * VNC_COLOR_HYSTERESIS) {
+            return VNC_COLOR_MEDIUM;
+        }
+
+        return SDL_max(level, VNC_COLOR_MEDIUM);
+    }
+
+    if (level == VNC_COLOR_LOW) {
+        return VNC_COLOR_MEDIUM;
+    }
+
+    if (level == VNC_COLOR_MEDIUM && throughput <
+            VNC_COLOR_MEDIUM_THROUGHPUT * VNC_COLOR_HYSTERESIS) {
+        return VNC_COLOR_MEDIUM;
+    }
+
+    return VNC_COLOR_FULL;
+}
+
+/*
+ * Applies a pending change of the surface's pixel format, and adapts the color
+ * depth requested from the server to the connection's throughput.
+ *
+ * Returns 1 if the server has been asked for pixel data at a higher color
+ * depth, 0 if the depth did not rise or nothing changed, and -1 on error.
+ * Must only be called between framebuffer updates. If the server may still
+ * owe updates, the change is only requested here, and 0 returned; it is made
+ * by VNC_FinishPixelFormatSync, or once the update requests in flight have
+ * drained.
+ */
+int VNC_UpdatePixelFormat(VNC_Connection *vnc) {
+    if (vnc->syncing_pixel_format || vnc->requests.draining) {
+        return 0;
+    }
+
+    SDL_LockMutex(vnc->lock);
+    Uint32 format = vnc->pending_pixel_format;
+    vnc->pending_pixel_format = SDL_PIXELFORMAT_UNKNOWN;
+    SDL_UnlockMutex(vnc->lock);
+
+    VNC_ColorLevel level = vnc->adaptive_color ?
+        VNC_ChooseColorLevel(vnc) : VNC_COLOR_FULL;
+
+    if (!format && level == vnc->color_level) {
+        return 0;
+    }
+
+    if (level != vnc->color_level) {
+        debug("switching to color level %i at %.0f bytes/s\n", level,
+                vnc->stats.throughput);
+    }
+
+    /*
+     * Unless the server owes no updates, some may already be on their way in
+     * the old format. A fence marks where the server switches; without one,
+     * requests are held back until those in flight have been answered.
+     */
+    if (vnc->continuous_updates || !vnc->requests.settled) {
+        if (vnc->supports_fence) {
+            return VNC_StartPixelFormatSync(vnc,
+                    format ? format : vnc->pixel_format, level) ? -1 : 0;
+        }
+
+        SDL_LockMutex(vnc->lock);
+        if (!vnc->pending_pixel_format) {
+            vnc->pending_pixel_format = format;
+        }
+        SDL_UnlockMutex(vnc->lock);
+
+        vnc->requests.draining = SDL_TRUE;
+        return 0;
+    }
+
+    Uint8 depth = vnc->server_details.fmt.depth;
+    vnc->color_level = level;
+
+    int res = format ?
+        VNC_ApplyPixelFormat(vnc, format) : VNC_ApplyColorLevel(vnc);
+
+    if (res) {
+        return -1;
+    }
+
+    return vnc->server_details.fmt.depth > depth;
+}
+
+int VNC_SetPixelFormat(VNC_Connection *vnc, Uint32 format) {
+    VNC_PixelFormat fmt;
+
+    if (VNC_PixelFormatFromSDL(format, &fmt) || fmt.bpp != 32) {
+        return VNC_ERROR_UNSUPPORTED_PIXEL_FORMAT;
+    }
+
+    if (!vnc->thread && !vnc->manager) {
+        return VNC_ApplyPixelFormat(vnc, format) ?
+            VNC_ERROR_SERVER_DISCONNECT : 0;
+    }
+
+    SDL_LockMutex(vnc->lock);
+    vnc->pending_pixel_format = format;
+    SDL_UnlockMutex(vnc->lock);
+
+    return 0;
+}
+
+int VNC_SetEncodings(VNC_Connection *vnc,
+        VNC_RectangleEncodingMethod *encodings, uint n) {
+
+    /*
+     * Message size is:
+     * - 2 bytes for message type;
+     * - 1 byte padding;
+     * - 2 bytes for number of encodings;
+     * - 4-byte-wide encoding ID per encoding.
+     */
+    size_t msg_size = 4 + n * 4;
+
+    VNC_AssureBufferSize(&vnc->buffer, msg_size);
+
+    Uint8 *msg = (Uint8 *) vnc->buffer.data;
+    *msg++ = 2; // ID of SetEncoding message
+    msg++;
+
+    Uint16 *encoding_count = (Uint16 *) msg;
+    *encoding_count++ = SDL_SwapBE16(n);
+
+    Sint32 *encoding_ids = (Sint32 *) encoding_count;
+    for (uint i = 0; i < n; i++) {
+        *encoding_ids++ = SDL_SwapBE32(encodings[i]);
+    }
+
+    return VNC_SendToServer(vnc, vnc->buffer.data, msg_size);
+}
+
+/*
+ * Maximum number of threads decoding rectangles off the polling threads, and
+ * the number of decode jobs a connection may have outstanding before its
+ * polling thread waits for some of them to finish.
+ */
+#define VNC_MAX_DECODE_THREADS 64
+#define VNC_MAX_PENDING_DECODE_JOBS 256
+
+/*
+ * Number of outstanding decode jobs at which a connection manager stops
+ * reading from a connection, so that the rectangles already received leave
+ * its event loop short of waiting on VNC_MAX_PENDING_DECODE_JOBS.
+ */
+#define VNC_DECODE_BACKLOG (VNC_MAX_PENDING_DECODE_JOBS / 2)
+
+/*
+ * Number of chains of decode jobs that must run one after the other, such as
+ * jobs sharing a zlib stream.
+ */
+#define VNC_DECODE_CHAINS 4
+
+typedef struct VNC_DecodeJob VNC_DecodeJob;
+
+/*
+ * A unit of decoding work that writes to a rectangle of the framebuffer, and
+ * may read from another (src, empty unless set).
+ *
+ * Jobs only start once every job submitted before them for the same connection
+ * that touches the same part of the framebuffer (or belongs to the same chain)
+ * has finished, so that the framebuffer ends up as if rectangles were decoded
+ * in order.
+ */
+struct VNC_DecodeJob {
+    void (*run)(VNC_DecodeJob *job);
+    VNC_Connection *vnc;
+    SDL_Rect r;
+    SDL_Rect src;
+    int chain;
+
+    int dependencies;
+    VNC_DecodeJob **dependents;
+    size_t dependent_count;
+    size_t dependent_capacity;
+
+    VNC_DecodeJob *prev_pending;
+    VNC_DecodeJob *next_pending;
+    VNC_DecodeJob *prev_ready;
+    VNC_DecodeJob *next_ready;
+};
+
+/*
+ * A decode thread, with its deque of jobs that are ready to run.
+ *
+ * The thread runs the newest job from the back, which is where the jobs that
+ * its own jobs make ready go, so that it keeps to data that is still in its
+ * cache; idle threads steal the oldest job from the front.
+ */
+typedef struct {
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    VNC_DecodeJob *front;
+    VNC_DecodeJob *back;
+} VNC_DecodeWorker;
+
+/*
+ * Decode threads shared by every connection, so that a connection with a lot
+ * to decode can use all of them while others idle.
+ */
+typedef struct {
+    VNC_DecodeWorker workers[VNC_MAX_DECODE_THREADS];
+    int worker_count;
+
+    /* counts the jobs in the deques that no thread has claimed yet */
+    SDL_sem *ready;
+
+    /* deque for the jobs of the next connection to be opened */
+    SDL_atomic_t next_home;
+
+    /* tells threads woken through ready to exit instead of taking a job */
+    SDL_atomic_t stopping;
+} VNC_DecodePool;
+
+VNC_DecodePool VNC_DECODE_POOL;
+
+/*
+ * Tracks the order in which a connection's decode jobs must run, handing them
+ * to the decode pool as they become ready.
+ */
+struct VNC_DecodeScheduler {
+    SDL_mutex *lock;
+    SDL_cond *job_done;
+
+    VNC_DecodeJob *pending_head;
+    VNC_DecodeJob *pending_tail;
+    size_t pending_count;
+
+    VNC_DecodeJob *chains[VNC_DECODE_CHAINS];
+
+    /* deque that jobs submitted by the polling thread go to */
+    int home;
+
+    /* eventfd signalled once a backlog has cleared, or -1 */
+    SDL_atomic_t wake;
+};
+
+/*
+ * Queues a job that is ready to run at the back of a decode thread's deque:
+ * that of the decode thread making it ready, if any, or that of the job's
+ * connection otherwise.
+ */
+void VNC_MakeJobReady(VNC_DecodeScheduler *sched, VNC_DecodeJob *job,
+        VNC_DecodeWorker *worker) {
+
+    if (!worker) {
+        worker = &VNC_DECODE_POOL.workers[sched->home];
+    }
+
+    SDL_LockMutex(worker->lock);
+
+    job->next_ready = NULL;
+    job->prev_ready = worker->back;
+
+    if (worker->back) {
+        worker->back->next_ready = job;
+    } else {
+        worker->front = job;
+    }
+
+    worker->back = job;
+
+    SDL_UnlockMutex(worker->lock);
+    SDL_SemPost(VNC_DECODE_POOL.ready);
+}
+
+VNC_DecodeJob *VNC_PopDecodeJob(VNC_DecodeWorker *worker) {
+    SDL_LockMutex(worker->lock);
+
+    VNC_DecodeJob *job = worker->back;
+
+    if (job) {
+        worker->back = job->prev_ready;
+
+        if (worker->back) {
+            worker->back->next_ready = NULL;
+        } else {
+            worker->front = NULL;
+        }
+    }
+
+    SDL_UnlockMutex(worker->lock);
+
+    return job;
+}
+
+VNC_DecodeJob *VNC_StealDecodeJob(VNC_DecodeWorker *worker) {
+    SDL_LockMutex(worker->lock);
+
+    VNC_DecodeJob *job = worker->front;
+
+    if (job) {
+        worker->front = job->next_ready;
+
+        if (worker->front) {
+            worker->front->prev_ready = NULL;
+        } else {
+            worker->back = NULL;
+        }
+    }
+
+    SDL_UnlockMutex(worker->lock);
+
+    return job;
+}
+
+/*
+ * Makes room for one more job to depend on the given one.
+ */
+int VNC_ReserveDependent(VNC_DecodeJob *before) {
+    if (before->dependent_count == before->dependent_capacity) {
+        size_t capacity = before->dependent_capacity ?
+            before->dependent_capacity * 2 : 4;
+        VNC_DecodeJob **dependents = SDL_realloc(before->dependents,
+                capacity * sizeof (VNC_DecodeJob *));
+
+        if (!dependents) {
+            return -1;
+        }
+
+        before->dependents = dependents;
+        before->dependent_capacity = capacity;
+    }
+
+    return 0;
+}
+
+/*
+ * Holds a job back until another has finished. Room for the dependency must
+ * have been made with VNC_ReserveDependent.
+ */
+void VNC_AddDependency(VNC_DecodeJob *before, VNC_DecodeJob *after) {
+    before->dependents[before->dependent_count++] = after;
+    after->dependencies++;
+}
+
+void VNC_FinishDecodeJob(VNC_DecodeScheduler *sched, VNC_DecodeJob *job,
+        VNC_DecodeWorker *worker) {
+
+    SDL_LockMutex(sched->lock);
+
+    if (job->prev_pending) {
+        job->prev_pending->next_pending = job->next_pending;
+    } else {
+        sched->pending_head = job->next_pending;
+    }
+
+    if (job->next_pending) {
+        job->next_pending->prev_pending = job->prev_pending;
+    } else {
+        sched->pending_tail = job->prev_pending;
+    }
+
+    sched->pending_count--;
+
+    int wake = SDL_AtomicGet(&sched->wake);
+
+    if (sched->pending_count == VNC_DECODE_BACKLOG - 1 && wake >= 0) {
+        VNC_SignalEventFd(wake);
+    }
+
+    if (job->chain >= 0 && sched->chains[job->chain] == job) {
+        sched->chains[job->chain] = NULL;
+    }
+
+    for (size_t i = 0; i < job->dependent_count; i++) {
+        if (!--job->dependents[i]->dependencies) {
+            VNC_MakeJobReady(sched, job->dependents[i], worker);
+        }
+    }
+
+    SDL_CondBroadcast(sched->job_done);
+    SDL_UnlockMutex(sched->lock);
+
+    SDL_free(job->dependents);
+    SDL_free(job);
+}
+
+int VNC_DecodeThread(void *data) {
+    VNC_DecodeWorker *worker = data;
+    VNC_DecodePool *pool = &VNC_DECODE_POOL;
+    int self = worker - pool->workers;
+
+    for (;;) {
+        SDL_SemWait(pool->ready);
+
+        if (SDL_AtomicGet(&pool->stopping)) {
+            break;
+        }
+
+        /* a job is sure to be queued somewhere, if not in this deque */
+        VNC_DecodeJob *job = VNC_PopDecodeJob(worker);
+
+        for (int i = 1; !job; i++) {
+            job = VNC_StealDecodeJob(
+                    &pool->workers[(self + i) % pool->worker_count]);
+        }
+
+        job->run(job);
+        VNC_FinishDecodeJob(job->vnc->decoder, job, worker);
+    }
+
+    return 0;
+}
+
+/*
+ * Tears down a decode pool that failed to start, stopping whichever of its
+ * threads did start, so that it is left as if never started. Jobs must not
+ * have been submitted to it.
+ */
+void VNC_StopDecodePool(void) {
+    VNC_DecodePool *pool = &VNC_DECODE_POOL;
+    int started = 0;
+
+    while (started < pool->worker_count && pool->workers[started].thread) {
+        started++;
+    }
+
+    SDL_AtomicSet(&pool->stopping, 1);
+
+    for (int i = 0; i < started; i++) {
+        SDL_SemPost(pool->ready);
+    }
+
+    for (int i = 0; i < VNC_MAX_DECODE_THREADS; i++) {
+        VNC_DecodeWorker *worker = &pool->workers[i];
+
+        if (worker->thread) {
+            SDL_WaitThread(worker->thread, NULL);
+        }
+
+        if (worker->lock) {
+            SDL_DestroyMutex(worker->lock);
+        }
+
+        SDL_zerop(worker);
+    }
+
+    if (pool->ready) {
+        SDL_DestroySemaphore(pool->ready);
+        pool->ready = NULL;
+    }
+
+    pool->worker_count = 0;
+    SDL_AtomicSet(&pool->stopping, 0);
+}
+
+/*
+ * Starts the decode pool with the given number of threads, or one per core if
+ * negative; does nothing if it has already been started.
+ */
+int VNC_StartDecodePool(int threads) {
+    VNC_DecodePool *pool = &VNC_DECODE_POOL;
+
+    if (pool->worker_count) {
+        return 0;
+    }
+
+    if (threads < 0) {
+        threads = SDL_GetCPUCount();
+    }
+
+    threads = SDL_max(1, SDL_min(threads, VNC_MAX_DECODE_THREADS));
+
+    pool->ready = SDL_CreateSemaphore(0);
+    if (!pool->ready) {
+        return -1;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pool->workers[i].lock = SDL_CreateMutex();
+        if (!pool->workers[i].lock) {
+            VNC_StopDecodePool();
+            return -1;
+        }
+    }
+
+    /* threads steal from every deque, so all exist before any thread runs */
+    pool->worker_count = threads;
+
+    for (int i = 0; i < threads; i++) {
+        pool->workers[i].thread = SDL_CreateThread(VNC_DecodeThread,
+                "RFB Decoder", &pool->workers[i]);
+
+        if (!pool->workers[i].thread) {
+            VNC_StopDecodePool();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Creates the decode scheduler of a connection; fails unless the decode pool
+ * has been started, as there would be no thread to run its jobs.
+ */
+VNC_DecodeScheduler *VNC_CreateDecodeScheduler(void) {
+    if (!VNC_DECODE_POOL.worker_count) {
+        return NULL;
+    }
+
+    VNC_DecodeScheduler *sched = SDL_calloc(1, sizeof (VNC_DecodeScheduler));
+
+    if (!sched) {
+        return NULL;
+    }
+
+    sched->lock = SDL_CreateMutex();
+    sched->job_done = SDL_CreateCond();
+
+    if (!sched->lock || !sched->job_done) {
+        SDL_DestroyCond(sched->job_done);
+        SDL_DestroyMutex(sched->lock);
+        SDL_free(sched);
+        return NULL;
+    }
+
+    SDL_AtomicSet(&sched->wake, -1);
+
+    /* connections start out on different threads, until they steal */
+    sched->home = SDL_AtomicAdd(&VNC_DECODE_POOL.next_home, 1) %
+        VNC_DECODE_POOL.worker_count;
+
+    return sched;
+}
+
+/*
+ * Whether one job must wait for another submitted before it: because the
+ * earlier job writes to what the later one reads or writes, or reads what it
+ * writes.
+ */
+SDL_bool VNC_JobDependsOn(VNC_DecodeJob *job, VNC_DecodeJob *before) {
+    if (job->chain >= 0 && before->chain == job->chain) {
+        return SDL_TRUE;
+    }
+
+    return SDL_HasIntersection(&before->r, &job->r) ||
+        SDL_HasIntersection(&before->r, &job->src) ||
+        SDL_HasIntersection(&before->src, &job->r);
+}
+
+/*
+ * Hands a job over to the decode threads, along with the rectangle it reads
+ * from the framebuffer, if any.
+ *
+ * The job will not run before the jobs already submitted for its connection
+ * that write to a rectangle it touches, that read the rectangle it writes, or
+ * that belong to the same chain, have finished. Ownership of the job passes to
+ * the scheduler, which frees it once run.
+ */
+void VNC_SubmitDecodeJob(VNC_DecodeScheduler *sched, VNC_DecodeJob *job,
+        SDL_Rect *src) {
+
+    if (src) {
+        job->src = *src;
+    } else {
+        SDL_zero(job->src);
+    }
+
+    job->dependencies = 0;
+    job->dependents = NULL;
+    job->dependent_count = 0;
+    job->dependent_capacity = 0;
+
+    SDL_LockMutex(sched->lock);
+
+    while (sched->pending_count >= VNC_MAX_PENDING_DECODE_JOBS) {
+        SDL_CondWait(sched->job_done, sched->lock);
+    }
+
+    /*
+     * Room for every dependency is made before any is added, as a dependency
+     * finishing while the lock is let go would release the job early. If
+     * there is no memory for one, the job cannot be ordered after the job it
+     * depends on, so the scan starts over once some job has finished; at the
+     * latest, that is the job depended on itself.
+     */
+    VNC_DecodeJob *p = sched->pending_head;
+
+    while (p) {
+        if (VNC_JobDependsOn(job, p) && VNC_ReserveDependent(p)) {
+            SDL_CondWait(sched->job_done, sched->lock);
+            p = sched->pending_head;
+            continue;
+        }
+
+        p = p->next_pending;
+    }
+
+    for (p = sched->pending_head; p; p = p->next_pending) {
+        if (VNC_JobDependsOn(job, p)) {
+            VNC_AddDependency(p, job);
+        }
+    }
+
+    if (job->chain >= 0) {
+        sched->chains[job->chain] = job;
+    }
+
+    job->next_pending = NULL;
+    job->prev_pending = sched->pending_tail;
+
+    if (sched->pending_tail) {
+        sched->pending_tail->next_pending = job;
+    } else {
+        sched->pending_head = job;
+    }
+
+    sched->pending_tail = job;
+    sched->pending_count++;
+
+    if (!job->dependencies) {
+        VNC_MakeJobReady(sched, job, NULL);
+    }
+
+    SDL_UnlockMutex(sched->lock);
+}
+
+SDL_bool VNC_PendingJobTouches(VNC_DecodeScheduler *sched, SDL_Rect *r) {
+    for (VNC_DecodeJob *p = sched->pending_head; p; p = p->next_pending) {
+        if (!r || SDL_HasIntersection(&p->r, r) ||
+                SDL_HasIntersection(&p->src, r)) {
+            return SDL_TRUE;
+        }
+    }
+
+    return SDL_FALSE;
+}
+
+/*
+ * Whether a connection has VNC_DECODE_BACKLOG decode jobs outstanding.
+ */
+SDL_bool VNC_DecodeBacklogged(VNC_DecodeScheduler *sched) {
+    SDL_LockMutex(sched->lock);
+    SDL_bool backlogged = sched->pending_count >= VNC_DECODE_BACKLOG;
+    SDL_UnlockMutex(sched->lock);
+
+    return backlogged;
+}
+
+/*
+ * Whether any outstanding decode job reads or writes the given rectangle.
+ */
+SDL_bool VNC_DecodeJobsTouch(VNC_DecodeScheduler *sched, SDL_Rect *r) {
+    SDL_LockMutex(sched->lock);
+    SDL_bool touches = VNC_PendingJobTouches(sched, r);
+    SDL_UnlockMutex(sched->lock);
+
+    return touches;
+}
+
+/*
+ * Waits until no outstanding decode job reads or writes the given rectangle,
+ * or until no decode jobs are outstanding at all if r is NULL.
+ *
+ * Must be called before the polling thread itself reads or writes a part of
+ * the framebuffer that decode jobs may be working on.
+ */
+void VNC_WaitForDecodeJobs(VNC_DecodeScheduler *sched, SDL_Rect *r) {
+    SDL_LockMutex(sched->lock);
+
+    while (VNC_PendingJobTouches(sched, r)) {
+        SDL_CondWait(sched->job_done, sched->lock);
+    }
+
+    SDL_UnlockMutex(sched->lock);
+}
+
+/*
+ * Waits until every outstanding decode job in the given chain has finished.
+ */
+void VNC_WaitForDecodeChain(VNC_DecodeScheduler *sched, int chain) {
+    SDL_LockMutex(sched->lock);
+
+    while (sched->chains[chain]) {
+        SDL_CondWait(sched->job_done, sched->lock);
+    }
+
+    SDL_UnlockMutex(sched->lock);
+}
+
+int VNC_DesktopSizeFromServer(VNC_Connection *vnc, VNC_RectangleHeader *header) {
+    VNC_WaitForDecodeJobs(vnc->decoder, NULL);
+
+    if (vnc->surface && VNC_ReplaceSurface(vnc,
+                SDL_CreateRGBSurfaceWithFormat(0, header->r.w, header->r.h, 32,
+                    vnc->pixel_format))) {
+        return VNC_OutOfMemory(vnc);
+    }
+
+    vnc->server_details.w = header->r.w;
+    vnc->server_details.h = header->r.h;
+
+    if (vnc->window) {
+        SDL_SetWindowSize(vnc->window, header->r.w, header->r.h);
+    }
+
+    /* continuous updates cover the area given when they were enabled */
+    if (vnc->continuous_updates &&
+            VNC_SendEnableContinuousUpdates(vnc, SDL_TRUE) < 0) {
+        vnc->parser->error = VNC_ERROR_SERVER_DISCONNECT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Size of the tiles that ZRLE rectangles are split into.
+ */
+#define VNC_ZRLE_TILE_SIZE 64
+
+struct VNC_ZlibStream {
+    z_stream z;
+    VNC_ConnectionBuffer out;
+};
+
+typedef struct {
+    Uint8 *data;
+    size_t size;
+    size_t pos;
+} VNC_ByteReader;
+
+VNC_ZlibStream *VNC_CreateZlibStream(void) {
+    VNC_ZlibStream *stream = SDL_calloc(1, sizeof (VNC_ZlibStream));
+
+    if (!stream) {
+        return NULL;
+    }
+
+    if (inflateInit(&stream->z) != Z_OK) {
+        SDL_free(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+void VNC_ResetZlibStream(VNC_ZlibStream *stream) {
+    inflateReset(&stream->z);
+}
+
+void VNC_DestroyZlibStream(VNC_ZlibStream *stream) {
+    if (!stream) {
+        return;
+    }
+
+    inflateEnd(&stream->z);
+    SDL_free(stream->out.data);
+    SDL_free(stream);
+}
+
+/*
+ * Inflates all of the n bytes at in through the stream, leaving the result in
+ * the stream's output buffer.
+ *
+ * Servers flush their compressor at the end of every rectangle, so everything
+ * belonging to a rectangle can be inflated without knowing its size upfront.
+ */
+int VNC_Inflate(VNC_ZlibStream *stream, Uint8 *in, size_t n, size_t *out_len) {
+    size_t produced = 0;
+
+    stream->z.next_in = in;
+    stream->z.avail_in = n;
+
+    do {
+        if (produced == stream->out.size) {
+            size_t size = stream->out.size ? stream->out.size * 2 : 65536;
+
+            if (VNC_ResizeBuffer(&stream->out, size)) {
+                return -1;
+            }
+        }
+
+        stream->z.next_out = (Uint8 *) stream->out.data + produced;
+        stream->z.avail_out = stream->out.size - produced;
+
+        int res = inflate(&stream->z, Z_SYNC_FLUSH);
+        produced = stream->out.size - stream->z.avail_out;
+
+        if (res == Z_BUF_ERROR && stream->z.avail_out) {
+            break;
+        }
+
+        if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) {
+            warn("inflate failed: %s\n", stream->z.msg ? stream->z.msg : "?");
+            return -1;
+        }
+
+    } while (stream->z.avail_in || !stream->z.avail_out);
+
+    *out_len = produced;
+    return 0;
+}
+
+Uint8 *VNC_ReadBytes(VNC_ByteReader *reader, size_t n) {
+    if (reader->size - reader->pos < n) {
+        return NULL;
+    }
+
+    Uint8 *bytes = reader->data + reader->pos;
+    reader->pos += n;
+
+    return bytes;
+}
+
+/*
+ * Rectangles with fewer pixels than this are decoded on the polling thread
+ * when no decode job is working on their part of the framebuffer, as handing
+ * them to a decode thread would cost more than decoding them.
+ */
+#define VNC_PARALLEL_RECT_PIXELS 4096
+
+typedef int (*VNC_RectDecoder)(VNC_Connection *vnc, SDL_Rect *r,
+        VNC_ByteReader *reader);
+
+/*
+ * A rectangle whose data shares no state with other rectangles, decoded by a
+ * decode thread from its own copy of the data.
+ */
+typedef struct {
+    VNC_DecodeJob job;
+    VNC_RectDecoder decode;
+    VNC_ByteReader reader;
+} VNC_RectJob;
+
+void VNC_RectDecodeJob(VNC_DecodeJob *job) {
+    VNC_RectJob *rect = (VNC_RectJob *) job;
+
+    rect->decode(job->vnc, &job->r, &rect->reader);
+}
+
+/*
+ * Decodes a rectangle from data that need not outlive the call.
+ *
+ * Small rectangles are decoded straight away if they can be; otherwise the
+ * data is copied into a decode job, so that the rest of the update can be
+ * parsed, and rectangles that do not overlap decoded, while it waits for the
+ * jobs before it or runs.
+ */
+int VNC_DecodeRectInParallel(VNC_Connection *vnc, SDL_Rect *r,
+        VNC_RectDecoder decode, Uint8 *data, size_t size) {
+
+    if ((Uint32) r->w * r->h < VNC_PARALLEL_RECT_PIXELS &&
+            !VNC_DecodeJobsTouch(vnc->decoder, r)) {
+        VNC_ByteReader reader;
+        reader.data = data;
+        reader.size = size;
+        reader.pos = 0;
+
+        return decode(vnc, r, &reader);
+    }
+
+    VNC_RectJob *job = SDL_malloc(sizeof (VNC_RectJob) + size);
+    if (!job) {
+        return VNC_OutOfMemory(vnc);
+    }
+
+    job->job.run = VNC_RectDecodeJob;
+    job->job.vnc = vnc;
+    job->job.r = *r;
+    job->job.chain = -1;
+
+    job->decode = decode;
+    job->reader.data = (Uint8 *) (job + 1);
+    job->reader.size = size;
+    job->reader.pos = 0;
+    SDL_memcpy(job->reader.data, data, size);
+
+    VNC_SubmitDecodeJob(vnc->decoder, &job->job, NULL);
+
+    return 0;
+}
+
+/*
+ * Size in bytes of a CPIXEL, as used by ZRLE and (as TPIXEL) by Tight.
+ *
+ * 32-bit true color pixels whose color bits all fit in either the three least
+ * or three most significant bytes are sent as three bytes.
+ */
+uint VNC_CPixelSize(VNC_PixelFormat *fmt) {
+    if (fmt->bpp != 32 || fmt->depth > 24 || !fmt->is_true_color) {
+        return fmt->bpp / 8;
+    }
+
+    return 3;
+}
+
+uint VNC_CPixelShift(VNC_PixelFormat *fmt) {
+    if (VNC_CPixelSize(fmt) != 3) {
+        return 0;
+    }
+
+    Uint32 mask = fmt->red_max << fmt->red_shift |
+        fmt->green_max << fmt->green_shift |
+        fmt->blue_max << fmt->blue_shift;
+
+    return (mask & 0xff000000) ? 8 : 0;
+}
+
+Uint32 VNC_PixelFromBytes(Uint8 *bytes, uint n, SDL_bool big_endian) {
+    Uint32 pixel = 0;
+
+    if (big_endian) {
+        for (uint i = 0; i < n; i++) {
+            pixel = pixel << 8 | bytes[i];
+        }
+
+    } else {
+        for (uint i = n; i > 0; i--) {
+            pixel = pixel << 8 | bytes[i - 1];
+        }
+    }
+
+    return pixel;
+}
+
+SDL_bool VNC_RectInSurface(SDL_Surface *surface, SDL_Rect *r) {
+    return surface && r->x >= 0 && r->y >= 0 &&
+        r->x + r->w <= surface->w && r->y + r->h <= surface->h;
+}
+
+/*
+ * Maps a pixel value sent by the server to a pixel value of the connection's
+ * surface.
+ */
+Uint32 VNC_MapPixel(VNC_Connection *vnc, Uint32 pixel) {
+    return vnc->pixel_lut ? vnc->pixel_lut[pixel] : pixel;
+}
+
+/*
+ * Writes a w by h block of pixel values into the surface at (x, y), mapping
+ * each of them through lut unless it is NULL.
+ */
+void VNC_WritePixels(SDL_Surface *surface, int x, int y, int w, int h,
+        Uint32 *pixels, Uint32 *lut) {
+
+    uint bytes_pp = surface->format->BytesPerPixel;
+    Uint8 *row = (Uint8 *) surface->pixels + y * surface->pitch + x * bytes_pp;
+
+    for (int j = 0; j < h; j++, row += surface->pitch, pixels += w) {
+        if (!lut && bytes_pp == 4) {
+            SDL_memcpy(row, pixels, w * 4);
+            continue;
+        }
+
+        for (int i = 0; i < w; i++) {
+            Uint32 pixel = lut ? lut[pixels[i]] : pixels[i];
+
+            switch (bytes_pp) {
+                case 4:
+                    ((Uint32 *) row)[i] = pixel;
+                    break;
+
+                case 2:
+                    ((Uint16 *) row)[i] = pixel;
+                    break;
+
+                default:
+                    row[i] = pixel;
+                    break;
+            }
+        }
+    }
+}
+
+/*
+ * Fills n pixels of bytes_pp bytes each, starting at dst, with a pixel value.
+ */
+void VNC_FillSpan(Uint8 *dst, uint bytes_pp, Uint32 pixel, int n) {
+    int i = 0;
+
+    if (bytes_pp == 1) {
+        SDL_memset(dst, pixel, n);
+        return;
+    }
+
+#ifdef __SSE2__
+    __m128i fill = bytes_pp == 4 ?
+        _mm_set1_epi32(pixel) : _mm_set1_epi16(pixel);
+    int per_vector = 16 / bytes_pp;
+
+    for (; i + per_vector <= n; i += per_vector) {
+        _mm_storeu_si128((__m128i *) (dst + i * bytes_pp), fill);
+    }
+#endif
+
+    if (bytes_pp == 4) {
+        for (; i < n; i++) {
+            ((Uint32 *) dst)[i] = pixel;
+        }
+
+    } else {
+        for (; i < n; i++) {
+            ((Uint16 *) dst)[i] = pixel;
+        }
+    }
+}
+
+/*
+ * Fills a rectangle of the surface with a pixel value.
+ *
+ * Unlike SDL_FillRect, this writes rows directly with no clipping or format
+ * checks, which makes it cheap enough to call for every tiny subrectangle.
+ */
+void VNC_FillRect(SDL_Surface *surface, int x, int y, int w, int h,
+        Uint32 pixel) {
+
+    uint bytes_pp = surface->format->BytesPerPixel;
+    Uint8 *row = (Uint8 *) surface->pixels + y * surface->pitch + x * bytes_pp;
+
+    for (int j = 0; j < h; j++, row += surface->pitch) {
+        VNC_FillSpan(row, bytes_pp, pixel, w);
+    }
+}
+
+/*
+ * Maps n pixels of 8 or 16 bits each, as sent by the server, through lut into
+ * a row of 32-bit pixels.
+ *
+ * Pixels are mapped from last to first, so src and dst may start at the same
+ * address to expand a row in place.
+ */
+void VNC_MapRow(VNC_PixelFormat *fmt, Uint32 *lut, Uint8 *src, Uint32 *dst,
+        int n) {
+
+    if (fmt->bpp == 8) {
+        for (int i = n - 1; i >= 0; i--) {
+            dst[i] = lut[src[i]];
+        }
+
+        return;
+    }
+
+    SDL_bool swap = fmt->is_big_endian != (SDL_BYTEORDER == SDL_BIG_ENDIAN);
+
+    for (int i = n - 1; i >= 0; i--) {
+        Uint16 pixel;
+        SDL_memcpy(&pixel, src + i * 2, 2);
+        dst[i] = lut[swap ? SDL_Swap16(pixel) : pixel];
+    }
+}
+
+/*
+ * Size in bytes of a row of the raw rectangle being parsed, as sent.
+ */
+size_t VNC_RawRowSize(VNC_Connection *vnc) {
+    return vnc->parser->header.r.w * (vnc->server_details.fmt.bpp / 8);
+}
+
+/*
+ * Number of bytes of the raw rectangle being parsed still to arrive.
+ */
+size_t VNC_RawBytesLeft(VNC_Connection *vnc) {
+    VNC_Parser *parser = vnc->parser;
+
+    return (parser->header.r.h - parser->row) * VNC_RawRowSize(vnc) -
+        parser->offset;
+}
+
+/*
+ * Lists where the rest of the raw rectangle being parsed goes in the
+ * framebuffer: the rest of the current row, then as many of the following
+ * rows as there are iovecs for.
+ *
+ * Returns the number of iovecs filled in.
+ */
+int VNC_RawDestinations(VNC_Connection *vnc, struct iovec *iov, int max) {
+    VNC_Parser *parser = vnc->parser;
+    SDL_Rect *r = &parser->header.r;
+    SDL_Surface *surface = vnc->surface;
+    size_t row_size = VNC_RawRowSize(vnc);
+
+    Uint8 *dst = (Uint8 *) surface->pixels +
+        (r->y + parser->row) * surface->pitch +
+        r->x * surface->format->BytesPerPixel;
+
+    int n = 0;
+
+    for (; n < max && parser->row + n < r->h; n++, dst += surface->pitch) {
+        size_t skip = n ? 0 : parser->offset;
+        iov[n].iov_base = dst + skip;
+        iov[n].iov_len = row_size - skip;
+    }
+
+    return n;
+}
+
+/*
+ * Moves on by n bytes written to the destinations of the raw rectangle being
+ * parsed.
+ *
+ * Pixels sent at a lowered color depth are narrower than those of the surface,
+ * so each row fits at the start of its destination, and is expanded in place
+ * once complete.
+ */
+void VNC_RawWritten(VNC_Connection *vnc, size_t n) {
+    VNC_Parser *parser = vnc->parser;
+    SDL_Rect *r = &parser->header.r;
+    SDL_Surface *surface = vnc->surface;
+    size_t row_size = VNC_RawRowSize(vnc);
+
+    parser->offset += n;
+    int rows = parser->offset / row_size;
+    parser->offset %= row_size;
+
+    if (vnc->pixel_lut) {
+        Uint8 *dst = (Uint8 *) surface->pixels +
+            (r->y + parser->row) * surface->pitch +
+            r->x * surface->format->BytesPerPixel;
+
+        for (int y = 0; y < rows; y++, dst += surface->pitch) {
+            VNC_MapRow(&vnc->server_details.fmt, vnc->pixel_lut, dst,
+                    (Uint32 *) dst, r->w);
+        }
+    }
+
+    parser->row += rows;
+}
+
+/*
+ * Copies the src region of the surface to (x, y) in the same surface.
+ *
+ * Rows are copied with memmove, in whichever vertical order keeps rows that
+ * the source and destination share from being overwritten before they are
+ * read; memmove itself deals with horizontal overlap.
+ */
+void VNC_MoveRect(SDL_Surface *surface, SDL_Rect *src, int x, int y) {
+    uint bytes_pp = surface->format->BytesPerPixel;
+    size_t row_size = src->w * bytes_pp;
+    int pitch = surface->pitch;
+
+    Uint8 *from = (Uint8 *) surface->pixels + src->y * pitch +
+        src->x * bytes_pp;
+    Uint8 *to = (Uint8 *) surface->pixels + y * pitch + x * bytes_pp;
+
+    if (y > src->y) {
+        from += (src->h - 1) * pitch;
+        to += (src->h - 1) * pitch;
+        pitch = -pitch;
+    }
+
+    for (int j = 0; j < src->h; j++, from += pitch, to += pitch) {
+        SDL_memmove(to, from, row_size);
+    }
+}
+
+void VNC_CopySurfaceRect(SDL_Surface *surface, SDL_Rect *src, SDL_Rect *dst) {
+    if (SDL_MUSTLOCK(surface)) {
+        SDL_LockSurface(surface);
+    }
+
+    VNC_MoveRect(surface, src, dst->x, dst->y);
+
+    if (SDL_MUSTLOCK(surface)) {
+        SDL_UnlockSurface(surface);
+    }
+}
+
+void VNC_CopyRectDecodeJob(VNC_DecodeJob *job) {
+    VNC_CopySurfaceRect(job->vnc->surface, &job->src, &job->r);
+}
+
+int VNC_CopyRectFromServer(VNC_Connection *vnc, VNC_RectangleHeader *header) {
+    Uint8 src_info[4];
+
+    if (VNC_FromServer(vnc, src_info, 4) != 4) {
+        return -1;
+    }
+
+    SDL_Rect src;
+    src.x = src_info[0] << 8 | src_info[1];
+    src.y = src_info[2] << 8 | src_info[3];
+    src.w = header->r.w;
+    src.h = header->r.h;
+
+    if (!VNC_RectInSurface(vnc->surface, &src) ||
+            !VNC_RectInSurface(vnc->surface, &header->r)) {
+        warn("CopyRect rectangle lies outside of the framebuffer\n");
+        return 0;
+    }
+
+    /*
+     * Copying is cheap, so is only handed to a decode thread when the copy
+     * would otherwise have to wait for decode jobs to finish.
+     */
+    if (VNC_DecodeJobsTouch(vnc->decoder, &src) ||
+            VNC_DecodeJobsTouch(vnc->decoder, &header->r)) {
+        VNC_DecodeJob *job = SDL_malloc(sizeof (VNC_DecodeJob));
+        if (!job) {
+            return VNC_OutOfMemory(vnc);
+        }
+
+        job->run = VNC_CopyRectDecodeJob;
+        job->vnc = vnc;
+        job->r = header->r;
+        job->chain = -1;
+
+        VNC_SubmitDecodeJob(vnc->decoder, job, &src);
+        return 0;
+    }
+
+    VNC_CopySurfaceRect(vnc->surface, &src, &header->r);
+
+    return 0;
+}
+
+Uint32 VNC_ZRLERunLength(VNC_ByteReader *reader, int *err) {
+    Uint32 run = 1;
+    Uint8 *b;
+
+    do {
+        b = VNC_ReadBytes(reader, 1);
+
+        if (!b) {
+            *err = 1;
+            return 0;
+        }
+
+        run += *b;
+    } while (*b == 255);
+
+    return run;
+}
+
+void VNC_CPixelsFromBytes(VNC_PixelFormat *fmt, Uint8 *bytes, uint n,
+        Uint32 *pixels) {
+
+    uint cpixel = VNC_CPixelSize(fmt);
+    uint shift = VNC_CPixelShift(fmt);
+
+    for (uint i = 0; i < n; i++, bytes += cpixel) {
+        pixels[i] =
+            VNC_PixelFromBytes(bytes, cpixel, fmt->is_big_endian) << shift;
+    }
+}
+
+/*
+ * Decodes the body of a ZRLE or TRLE tile into a w by h block of pixels, given
+ * its subencoding and the palette that has already been read for it.
+ */
+int VNC_RLETile(VNC_PixelFormat *fmt, Uint8 sub, Uint32 *palette,
+        uint palette_size, VNC_ByteReader *reader, Uint32 *tile, int w, int h) {
+
+    uint cpixel = VNC_CPixelSize(fmt);
+    uint shift = VNC_CPixelShift(fmt);
+
+    int n = w * h;
+    int err = 0;
+    Uint8 *p;
+
+    if (sub == 0) {
+        /* raw */
+        p = VNC_ReadBytes(reader, n * cpixel);
+        if (!p) {
+            return -1;
+        }
+
+        VNC_CPixelsFromBytes(fmt, p, n, tile);
+
+    } else if (sub == 1) {
+        /* solid */
+        for (int i = 0; i < n; i++) {
+            tile[i] = palette[0];
+        }
+
+    } else if (sub <= 16) {
+        /* packed palette */
+        uint bits = palette_size <= 2 ? 1 : palette_size <= 4 ? 2 : 4;
+        uint row_bytes = (w * bits + 7) / 8;
+        Uint8 mask = (1 << bits) - 1;
+
+        p = VNC_ReadBytes(reader, row_bytes * h);
+        if (!p) {
+            return -1;
+        }
+
+        for (int y = 0; y < h; y++, p += row_bytes) {
+            for (int x = 0; x < w; x++) {
+                uint bit = x * bits;
+                uint index = p[bit / 8] >> (8 - bits - bit % 8) & mask;
+
+                if (index >= palette_size) {
+                    warn("RLE tile palette index out of range\n");
+                    return -1;
+                }
+
+                tile[y * w + x] = palette[index];
+            }
+        }
+
+    } else if (sub == 128) {
+        /* plain RLE */
+        for (int i = 0; i < n;) {
+            p = VNC_ReadBytes(reader, cpixel);
+            if (!p) {
+                return -1;
+            }
+
+            Uint32 pixel =
+                VNC_PixelFromBytes(p, cpixel, fmt->is_big_endian) << shift;
+            Uint32 run = VNC_ZRLERunLength(reader, &err);
+
+            if (err || run > n - i) {
+                return -1;
+            }
+
+            while (run--) {
+                tile[i++] = pixel;
+            }
+        }
+
+    } else if (sub >= 130) {
+        /* palette RLE */
+        for (int i = 0; i < n;) {
+            p = VNC_ReadBytes(reader, 1);
+            if (!p) {
+                return -1;
+            }
+
+            uint index = *p & 0x7f;
+
+            if (index >= palette_size) {
+                warn("RLE tile palette index out of range\n");
+                return -1;
+            }
+
+            Uint32 pixel = palette[index];
+            Uint32 run = (*p & 0x80) ? VNC_ZRLERunLength(reader, &err) : 1;
+
+            if (err || run > n - i) {
+                return -1;
+            }
+
+            while (run--) {
+                tile[i++] = pixel;
+            }
+        }
+
+    } else {
+        warn("invalid RLE tile subencoding %u\n", sub);
+        return -1;
+    }
+
+    return 0;
+}
+
+int VNC_ZRLETile(VNC_Connection *vnc, VNC_ByteReader *reader, Uint32 *tile,
+        int w, int h) {
+
+    VNC_PixelFormat *fmt = &vnc->server_details.fmt;
+    Uint32 palette[128];
+
+    Uint8 *sub = VNC_ReadBytes(reader, 1);
+    if (!sub) {
+        return -1;
+    }
+
+    uint palette_size = *sub & 0x7f;
+    Uint8 *p = VNC_ReadBytes(reader, palette_size * VNC_CPixelSize(fmt));
+    if (!p) {
+        return -1;
+    }
+
+    VNC_CPixelsFromBytes(fmt, p, palette_size, palette);
+
+    return VNC_RLETile(fmt, *sub, palette, palette_size, reader, tile, w, h);
+}
+
+/*
+ * Renders the tiles of a ZRLE rectangle from its inflated data.
+ */
+int VNC_DecodeZRLE(VNC_Connection *vnc, SDL_Rect *r, VNC_ByteReader *reader) {
+    Uint32 tile[VNC_ZRLE_TILE_SIZE * VNC_ZRLE_TILE_SIZE];
+
+    if (SDL_MUSTLOCK(vnc->surface)) {
+        SDL_LockSurface(vnc->surface);
+    }
+
+    int res = 0;
+
+    for (int y = 0; y < r->h && !res; y += VNC_ZRLE_TILE_SIZE) {
+        int h = SDL_min(VNC_ZRLE_TILE_SIZE, r->h - y);
+
+        for (int x = 0; x < r->w && !res; x += VNC_ZRLE_TILE_SIZE) {
+            int w = SDL_min(VNC_ZRLE_TILE_SIZE, r->w - x);
+
+            res = VNC_ZRLETile(vnc, reader, tile, w, h);
+
+            if (!res) {
+                VNC_WritePixels(vnc->surface, r->x + x, r->y + y, w, h, tile,
+                        vnc->pixel_lut);
+            }
+        }
+    }
+
+    if (SDL_MUSTLOCK(vnc->surface)) {
+        SDL_UnlockSurface(vnc->surface);
+    }
+
+    if (res) {
+        warn("malformed ZRLE rectangle\n");
+    }
+
+    return res;
+}
+
+int VNC_ZRLEFromServer(VNC_Connection *vnc, VNC_RectangleHeader *header) {
+    Uint32 length;
+    if (VNC_FromServer(vnc, &length, 4) != 4) {
+        return -1;
+    }
+    length = SDL_SwapBE32(length);
+
+    if (VNC_ServerToBuffer(vnc, length) != length) {
+        return -1;
+    }
+
+    /*
+     * The zlib stream carries over between rectangles, so is inflated here in
+     * order; only rendering the tiles is left to a decode thread.
+     */
+    size_t size;
+    if (VNC_Inflate(vnc->zrle_stream, vnc->buffer.data, length, &size)) {
+        return -1;
+    }
+
+    if (!VNC_RectInSurface(vnc->surface, &header->r)) {
+        warn("ZRLE rectangle lies outside of the framebuffer\n");
+        return 0;
+    }
+
+    return VNC_DecodeRectInParallel(vnc, &header->r, VNC_DecodeZRLE,
+            vnc->zrle_stream->out.data, size);
+}
+
+/*
+ * Size of TRLE tiles, the number of tiles a rectangle needs before its tiles
+ * are rendered by the decode threads, and the number of tiles per decode job.
+ */
+#define VNC_TRLE_TILE_SIZE 16
+#define VNC_TRLE_PARALLEL_TILES 64
+#define VNC_TRLE_TILES_PER_JOB 32
+
+/*
+ * TRLE subencodings that reuse the previous tile's palette.
+ */
+#define VNC_TRLE_REUSE_PACKED 127
+#define VNC_TRLE_REUSE_RLE 129
+
+typedef struct {
+    size_t offset;
+    size_t palette_offset;
+    Uint8 sub;
+    Uint8 palette_size;
+} VNC_TRLETile;
+
+/*
+ * A TRLE rectangle whose data has been read in full, along with where each of
+ * its tiles starts. Shared by the decode jobs rendering its tiles.
+ */
+typedef struct {
+    SDL_atomic_t refs;
+    SDL_Rect r;
+    VNC_ConnectionBuffer data;
+    size_t size;
+    VNC_TRLETile *tiles;
+} VNC_TRLERect;
+
+typedef struct {
+    VNC_DecodeJob job;
+    VNC_TRLERect *rect;
+    int first_tile;
+    int tile_count;
+} VNC_TRLEJob;
+
+/*
+ * Reads n more bytes of the rectangle's data from the server, returning their
+ * offset into the rectangle's data, or -1 on failure.
+ */
+ssize_t VNC_TRLEDataFromServer(VNC_Connection *vnc, VNC_TRLERect *rect,
+        size_t n) {
+
+    if (rect->size + n > rect->data.size) {
+        size_t size = SDL_max(rect->data.size * 2, rect->size + n);
+
+        if (VNC_ResizeBuffer(&rect->data, size)) {
+            return VNC_OutOfMemory(vnc);
+        }
+    }
+
+    if (VNC_FromServer(vnc, (Uint8 *) rect->data.data + rect->size, n) != n) {
+        return -1;
+    }
+
+    rect->size += n;
+
+    return rect->size - n;
+}
+
+int VNC_TRLESkipRunLength(VNC_Connection *vnc, VNC_TRLERect *rect,
+        int *run) {
+
+    Uint8 b;
+    *run = 1;
+
+    do {
+        ssize_t offset = VNC_TRLEDataFromServer(vnc, rect, 1);
+        if (offset < 0) {
+            return -1;
+        }
+
+        b = ((Uint8 *) rect->data.data)[offset];
+        *run += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+/*
+ * Reads the rectangle's data from the server, working out where each tile's
+ * data and palette lie.
+ *
+ * TRLE tiles are not length-prefixed, so this has to walk through every tile
+ * in order; once done, tiles can be rendered independently.
+ */
+int VNC_TRLEScan(VNC_Connection *vnc, VNC_TRLERect *rect) {
+    VNC_PixelFormat *fmt = &vnc->server_details.fmt;
+    uint cpixel = VNC_CPixelSize(fmt);
+    SDL_Rect *r = &rect->r;
+
+    size_t palette_offset = 0;
+    uint palette_size = 0;
+    int i = 0;
+
+    for (int y = 0; y < r->h; y += VNC_TRLE_TILE_SIZE) {
+        int h = SDL_min(VNC_TRLE_TILE_SIZE, r->h - y);
+
+        for (int x = 0; x < r->w; x += VNC_TRLE_TILE_SIZE, i++) {
+            int w = SDL_min(VNC_TRLE_TILE_SIZE, r->w - x);
+            VNC_TRLETile *tile = &rect->tiles[i];
+
+            ssize_t offset = VNC_TRLEDataFromServer(vnc, rect, 1);
+            if (offset < 0) {
+                return -1;
+            }
+
+            Uint8 sub = ((Uint8 *) rect->data.data)[offset];
+
+            if (sub == VNC_TRLE_REUSE_PACKED || sub == VNC_TRLE_REUSE_RLE) {
+                tile->sub = sub == VNC_TRLE_REUSE_PACKED ? 2 : 130;
+
+            } else if ((sub >= 1 && sub <= 16) || sub >= 130) {
+                tile->sub = sub;
+                palette_size = sub & 0x7f;
+
+                offset = VNC_TRLEDataFromServer(vnc, rect,
+                        palette_size * cpixel);
+                if (offset < 0) {
+                    return -1;
+                }
+
+                palette_offset = offset;
+
+            } else if (sub == 0 || sub == 128) {
+                tile->sub = sub;
+
+            } else {
+                warn("invalid TRLE subencoding %u\n", sub);
+                return -1;
+            }
+
+            SDL_bool has_palette = tile->sub != 0 && tile->sub != 128;
+
+            tile->palette_offset = palette_offset;
+            tile->palette_size = has_palette ? palette_size : 0;
+            tile->offset = rect->size;
+
+            int n = w * h;
+            size_t body = 0;
+
+            if (tile->sub == 0) {
+                body = n * cpixel;
+
+            } else if (tile->sub >= 2 && tile->sub <= 16) {
+                uint bits = palette_size <= 2 ? 1 : palette_size <= 4 ? 2 : 4;
+                body = (w * bits + 7) / 8 * h;
+
+            } else if (tile->sub == 128 || tile->sub >= 130) {
+                for (int run, p = 0; p < n; p += run) {
+                    SDL_bool has_run = SDL_TRUE;
+
+                    offset = VNC_TRLEDataFromServer(vnc, rect,
+                            tile->sub == 128 ? cpixel : 1);
+                    if (offset < 0) {
+                        return -1;
+                    }
+
+                    if (tile->sub != 128) {
+                        has_run = ((Uint8 *) rect->data.data)[offset] & 0x80;
+                    }
+
+                    run = 1;
+                    if (has_run && VNC_TRLESkipRunLength(vnc, rect, &run)) {
+                        return -1;
+                    }
+                }
+            }
+
+            if (body && VNC_TRLEDataFromServer(vnc, rect, body) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+void VNC_TRLERenderTiles(VNC_Connection *vnc, VNC_TRLERect *rect,
+        int first_tile, int tile_count) {
+
+    VNC_PixelFormat *fmt = &vnc->server_details.fmt;
+    SDL_Rect *r = &rect->r;
+    int tiles_per_row = (r->w + VNC_TRLE_TILE_SIZE - 1) / VNC_TRLE_TILE_SIZE;
+
+    Uint32 pixels[VNC_TRLE_TILE_SIZE * VNC_TRLE_TILE_SIZE];
+    Uint32 palette[128];
+
+    for (int i = first_tile; i < first_tile + tile_count; i++) {
+        VNC_TRLETile *tile = &rect->tiles[i];
+        int x = i % tiles_per_row * VNC_TRLE_TILE_SIZE;
+        int y = i / tiles_per_row * VNC_TRLE_TILE_SIZE;
+        int w = SDL_min(VNC_TRLE_TILE_SIZE, r->w - x);
+        int h = SDL_min(VNC_TRLE_TILE_SIZE, r->h - y);
+
+        VNC_ByteReader reader;
+        reader.data = (Uint8 *) rect->data.data + tile->offset;
+        reader.size = rect->size - tile->offset;
+        reader.pos = 0;
+
+        VNC_CPixelsFromBytes(fmt,
+                (Uint8 *) rect->data.data + tile->palette_offset,
+                tile->palette_size, palette);
+
+        if (VNC_RLETile(fmt, tile->sub, palette, tile->palette_size, &reader,
+                    pixels, w, h)) {
+            warn("malformed TRLE tile\n");
+            return;
+        }
+
+        VNC_WritePixels(vnc->surface, r->x + x, r->y + y, w, h, pixels,
+                vnc->pixel_lut);
+    }
+}
+
+void VNC_ReleaseTRLERect(VNC_TRLERect *rect) {
+    if (SDL_AtomicDecRef(&rect->refs)) {
+        SDL_free(rect->data.data);
+        SDL_free(rect->tiles);
+        SDL_free(rect);
+    }
+}
+
+void VNC_TRLEDecodeJob(VNC_DecodeJob *job) {
+    VNC_TRLEJob *trle = (VNC_TRLEJob *) job;
+
+    VNC_TRLERenderTiles(job->vnc, trle->rect, trle->first_tile,
+            trle->tile_count);
+    VNC_ReleaseTRLERect(trle->rect);
+}
+
+int VNC_TRLEFromServer(VNC_Connection *vnc, VNC_RectangleHeader *header) {
+    SDL_Rect *r = &header->r;
+    int tiles_per_row = (r->w + VNC_TRLE_TILE_SIZE - 1) / VNC_TRLE_TILE_SIZE;
+    int tile_rows = (r->h + VNC_TRLE_TILE_SIZE - 1) / VNC_TRLE_TILE_SIZE;
+    int tile_count = tiles_per_row * tile_rows;
+
+    VNC_TRLERect *rect = SDL_calloc(1, sizeof (VNC_TRLERect));
+    if (!rect) {
+        return VNC_OutOfMemory(vnc);
+    }
+
+    rect->r = *r;
+    rect->tiles = SDL_malloc(SDL_max(1, tile_count) * sizeof (VNC_TRLETile));
+    SDL_AtomicSet(&rect->refs, 1);
+
+    if (!rect->tiles) {
+        VNC_ReleaseTRLERect(rect);
+        return VNC_OutOfMemory(vnc);
+    }
+
+    if (VNC_TRLEScan(vnc, rect)) {
+        VNC_ReleaseTRLERect(rect);
+        return -1;
+    }
+
+    if (!VNC_RectInSurface(vnc->surface, r)) {
+        warn("TRLE rectangle lies outside of the framebuffer\n");
+        VNC_ReleaseTRLERect(rect);
+        return -1;
+    }
+
+    if (tile_count < VNC_TRLE_PARALLEL_TILES) {
+        VNC_WaitForDecodeJobs(vnc->decoder, r);
+        VNC_TRLERenderTiles(vnc, rect, 0, tile_count);
+        VNC_ReleaseTRLERect(rect);
+        return 0;
+    }
+
+    /*
+     * Tiles share no state once their data has been located, so bands of
+     * whole tile rows are rendered in parallel.
+     */
+    int rows_per_job = SDL_max(1, VNC_TRLE_TILES_PER_JOB / tiles_per_row);
+
+    for (int row = 0; row < tile_rows; row += rows_per_job) {
+        VNC_TRLEJob *job = SDL_malloc(sizeof (VNC_TRLEJob));
+        if (!job) {
+            break;
+        }
+
+        int rows = SDL_min(rows_per_job, tile_rows - row);
+
+        job->job.run = VNC_TRLEDecodeJob;
+        job->job.vnc = vnc;
+        job->job.chain = -1;
+        job->job.r.x = r->x;
+        job->job.r.y = r->y + row * VNC_TRLE_TILE_SIZE;
+        job->job.r.w = r->w;
+        job->job.r.h = SDL_min(rows * VNC_TRLE_TILE_SIZE,
+                r->h - row * VNC_TRLE_TILE_SIZE);
+
+        job->rect = rect;
+        job->first_tile = row * tiles_per_row;
+        job->tile_count = rows * tiles_per_row;
+
+        SDL_AtomicIncRef(&rect->refs);
+        VNC_SubmitDecodeJob(vnc->decoder, &job->job, NULL);
+    }
+
+    VNC_ReleaseTRLERect(rect);
+
+    return 0;
+}
+
+/*
+ * Tight compression control byte values, and the size below which Tight sends
+ * data without compressing it.
+ */
+#define VNC_TIGHT_FILL 0x08
+#define VNC_TIGHT_JPEG 0x09
+#define VNC_TIGHT_EXPLICIT_FILTER 0x04
+#define VNC_TIGHT_MIN_TO_COMPRESS 12
+
+typedef enum {
+    TIGHT_FILTER_COPY = 0,
+    TIGHT_FILTER_PALETTE = 1,
+    TIGHT_FILTER_GRADIENT = 2
+} VNC_TightFilter;
+
+/*
+ * A Tight rectangle using basic compression, along with the (possibly
+ * compressed) data following its header.
+ */
+typedef struct {
+    VNC_DecodeJob job;
+    VNC_TightFilter filter;
+    uint palette_size;
+    Uint32 palette[256];
+    int stream;
+    size_t raw_size;
+    size_t data_size;
+    Uint8 *data;
+} VNC_TightRect;
+
+/*
+ * Size in bytes of a TPIXEL.
+ *
+ * 24-bit true color pixels are sent as three bytes: red, green, then blue.
+ */
+uint VNC_TPixelSize(VNC_PixelFormat *fmt) {
+    if (fmt->bpp == 32 && fmt->depth == 24 && fmt->is_true_color &&
+            fmt->red_max == 0xff && fmt->green_max == 0xff &&
+            fmt->blue_max == 0xff) {
+        return 3;
+    }
+
+    return fmt->bpp / 8;
+}
+
+Uint32 VNC_TPixel(VNC_PixelFormat *fmt, Uint8 *bytes) {
+    if (VNC_TPixelSize(fmt) == 3) {
+        return (Uint32) bytes[0] << fmt->red_shift |
+            (Uint32) bytes[1] << fmt->green_shift |
+            (Uint32) bytes[2] << fmt->blue_shift;
+    }
+
+    return VNC_PixelFromBytes(bytes, fmt->bpp / 8, fmt->is_big_endian);
+}
+
+int VNC_TightCompactLength(VNC_Connection *vnc, size_t *length) {
+    *length = 0;
+
+    for (int i = 0; i < 3; i++) {
+        Uint8 b;
+        if (VNC_FromServer(vnc, &b, 1) != 1) {
+            return -1;
+        }
+
+        *length |= (size_t) (i < 2 ? b & 0x7f : b) << (7 * i);
+
+        if (!(b & 0x80)) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Reconstructs a row of pixels sent through the gradient filter, where each
+ * color component is predicted from its neighbours above and to the left.
+ */
+void VNC_TightGradientRow(VNC_PixelFormat *fmt, Uint32 *row, Uint32 *above,
+        int w) {
+
+    Uint16 max[3] = { fmt->red_max, fmt->green_max, fmt->blue_max };
+    Uint8 shift[3] = { fmt->red_shift, fmt->green_shift, fmt->blue_shift };
+
+    for (int x = 0; x < w; x++) {
+        Uint32 pixel = 0;
+
+        for (int c = 0; c < 3; c++) {
+            int up = above[x] >> shift[c] & max[c];
+            int left = x ? row[x - 1] >> shift[c] & max[c] : 0;
+            int up_left = x ? above[x - 1] >> shift[c] & max[c] : 0;
+
+            int prediction = SDL_max(0, SDL_min(up + left - up_left, max[c]));
+            Uint32 value = (prediction + (row[x] >> shift[c])) & max[c];
+
+            pixel |= value << shift[c];
+        }
+
+        row[x] = pixel;
+    }
+}
+
+/*
+ * Decodes the filtered pixel data of a Tight rectangle into the framebuffer.
+ */
+int VNC_TightFilterToSurface(VNC_Connection *vnc, VNC_TightRect *rect,
+        Uint8 *data, size_t size) {
+
+    VNC_PixelFormat *fmt = &vnc->server_details.fmt;
+    SDL_Rect *r = &rect->job.r;
+    uint tpixel = VNC_TPixelSize(fmt);
+
+    if (size < rect->raw_size) {
+        warn("truncated Tight rectangle\n");
+        return -1;
+    }
+
+    if (!VNC_RectInSurface(vnc->surface, r)) {
+        warn("Tight rectangle lies outside of the framebuffer\n");
+        return -1;
+    }
+
+    Uint32 *rows = SDL_calloc(2 * r->w, sizeof (Uint32));
+    if (!rows) {
+        return -1;
+    }
+
+    Uint32 *row = rows;
+    Uint32 *above = rows + r->w;
+
+    for (int y = 0; y < r->h; y++) {
+        switch (rect->filter) {
+            case TIGHT_FILTER_PALETTE:
+                if (rect->palette_size == 2) {
+                    for (int x = 0; x < r->w; x++) {
+                        row[x] = rect->palette[data[x / 8] >> (7 - x % 8) & 1];
+                    }
+                    data += (r->w + 7) / 8;
+
+                } else {
+                    for (int x = 0; x < r->w; x++, data++) {
+                        if (*data >= rect->palette_size) {
+                            warn("Tight palette index out of range\n");
+                            SDL_free(rows);
+                            return -1;
+                        }
+
+                        row[x] = rect->palette[*data];
+                    }
+                }
+                break;
+
+            case TIGHT_FILTER_GRADIENT:
+                for (int x = 0; x < r->w; x++, data += tpixel) {
+                    row[x] = VNC_TPixel(fmt, data);
+                }
+
+                VNC_TightGradientRow(fmt, row, above, r->w);
+                break;
+
+            default:
+                for (int x = 0; x < r->w; x++, data += tpixel) {
+                    row[x] = VNC_TPixel(fmt, data);
+                }
+                break;
+        }
+
+        VNC_WritePixels(vnc->surface, r->x, r->y + y, r->w, 1, row,
+                vnc->pixel_lut);
+
+        Uint32 *t = row;
+        row = above;
+        above = t;
+    }
+
+    SDL_free(rows);
+
+    return 0;
+}
+
+void VNC_TightDecodeJob(VNC_DecodeJob *job) {
+    VNC_TightRect *rect = (VNC_TightRect *) job;
+    VNC_ZlibStream *stream = job->vnc->tight_streams[rect->stream];
+
+    size_t size;
+    if (VNC_Inflate(stream, rect->data, rect->data_size, &size)) {
+        warn("could not inflate Tight rectangle\n");
+        return;
+    }
+
+    VNC_TightFilterToSurface(job->vnc, rect, stream->out.data, size);
+}
+
+int VNC_TightFillFromServer(VNC_Connection *vnc, VNC_RectangleHeader *header) {
+    VNC_PixelFormat *fmt = &vnc->server_details.fmt;
+    Uint8 bytes[4];
+
+    if (VNC_FromServer(vnc, bytes, VNC_TPixelSize(fmt)) <= 0) {
+        return -1;
+    }
+
+    VNC_WaitForDecodeJobs(vnc->decoder, &header->r);
+
+    return SDL_FillRect(vnc->surface, &header->r,
+            VNC_MapPixel(vnc, VNC_TPixel(fmt, bytes)));
+}
+
+/*
+ * Tight JPEG quality level requested from the server, from 0 to 9.
+ */
+#define VNC_TIGHT_JPEG_QUALITY 8
+
+/*
+ * Maximum number of scanlines handed to libjpeg in one go.
+ */
+#define VNC_JPEG_MAX_SCANLINES 16
+
+/*
+ * A Tight rectangle sent as a JPEG image.
+ */
+typedef struct {
+    VNC_DecodeJob job;
+    size_t size;
+    Uint8 *data;
+} VNC_TightJpegRect;
+
+typedef struct {
+    struct jpeg_error_mgr mgr;
+    jmp_buf escape;
+} VNC_JpegError;
+
+void VNC_JpegErrorExit(j_common_ptr cinfo) {
+    VNC_JpegError *err = (VNC_JpegError *) cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message(cinfo, msg);
+    warn("could not decode JPEG rectangle: %s\n", msg);
+
+    longjmp(err->escape, 1);
+}
+
+/*
+ * Picks the libjpeg output color space that lays out pixels exactly as the
+ * surface stores them, so that scanlines can be decoded straight into it.
+ *
+ * Returns JCS_RGB if libjpeg cannot produce the surface's format.
+ */
+J_COLOR_SPACE VNC_JpegColorSpace(SDL_PixelFormat *fmt) {
+#ifdef JCS_EXTENSIONS
+    if (fmt->BytesPerPixel == 4 && fmt->Rloss == 0 && fmt->Gloss == 0 &&
+            fmt->Bloss == 0 && fmt->Rshift % 8 == 0 && fmt->Gshift % 8 == 0 &&
+            fmt->Bshift % 8 == 0) {
+
+        int r = fmt->Rshift / 8;
+        int g = fmt->Gshift / 8;
+        int b = fmt->Bshift / 8;
+
+        if (SDL_BYTEORDER == SDL_BIG_ENDIAN) {
+            r = 3 - r;
+            g = 3 - g;
+            b = 3 - b;
+        }
+
+        if (r == 0 && g == 1 && b == 2) {
+            return JCS_EXT_RGBX;
+        } else if (r == 2 && g == 1 && b == 0) {
+            return JCS_EXT_BGRX;
+        } else if (r == 1 && g == 2 && b == 3) {
+            return JCS_EXT_XRGB;
+        } else if (r == 3 && g == 2 && b == 1) {
+            return JCS_EXT_XBGR;
+        }
+    }
+#endif
+
+    return JCS_RGB;
+}
+
+void VNC_TightJpegDecodeJob(VNC_DecodeJob *job) {
+    VNC_TightJpegRect *rect = (VNC_TightJpegRect *) job;
+    SDL_Surface *surface = job->vnc->surface;
+    SDL_Rect *r = &job->r;
+
+    struct jpeg_decompress_struct cinfo;
+    VNC_JpegError err;
+    Uint8 *volatile rgb_row = NULL;
+
+    if (!VNC_RectInSurface(surface, r)) {
+        warn("JPEG rectangle lies outside of the framebuffer\n");
+        return;
+    }
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = VNC_JpegErrorExit;
+
+    if (setjmp(err.escape)) {
+        jpeg_destroy_decompress(&cinfo);
+        SDL_free(rgb_row);
+        return;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, rect->data, rect->size);
+    jpeg_read_header(&cinfo, TRUE);
+
+    cinfo.out_color_space = VNC_JpegColorSpace(surface->format);
+    cinfo.dither_mode = JDITHER_NONE;
+    jpeg_start_decompress(&cinfo);
+
+    if (cinfo.output_width != r->w || cinfo.output_height != r->h) {
+        warn("JPEG image does not match its rectangle's size\n");
+        jpeg_destroy_decompress(&cinfo);
+        return;
+    }
+
+    Uint8 *dst = (Uint8 *) surface->pixels + r->y * surface->pitch +
+        r->x * surface->format->BytesPerPixel;
+
+    if (cinfo.out_color_space != JCS_RGB) {
+        /*
+         * The surface's own rows are the output buffer; no intermediate copy
+         * or conversion is needed.
+         */
+        JSAMPROW rows[VNC_JPEG_MAX_SCANLINES];
+
+        while (cinfo.output_scanline < cinfo.output_height) {
+            JDIMENSION n = SDL_min(VNC_JPEG_MAX_SCANLINES,
+                    cinfo.output_height - cinfo.output_scanline);
+
+            for (JDIMENSION i = 0; i < n; i++) {
+                rows[i] = dst + (cinfo.output_scanline + i) * surface->pitch;
+            }
+
+            jpeg_read_scanlines(&cinfo, rows, n);
+        }
+
+    } else {
+        rgb_row = SDL_malloc(r->w * (3 + sizeof (Uint32)));
+        if (!rgb_row) {
+            jpeg_destroy_decompress(&cinfo);
+            return;
+        }
+
+        Uint32 *pixels = (Uint32 *) (rgb_row + r->w * 3);
+
+        while (cinfo.output_scanline < cinfo.output_height) {
+            JSAMPROW row = rgb_row;
+            int y = cinfo.output_scanline;
+
+            jpeg_read_scanlines(&cinfo, &row, 1);
+
+            for (int x = 0; x < r->w; x++) {
+                pixels[x] = SDL_MapRGB(surface->format, rgb_row[x * 3],
+                        rgb_row[x * 3 + 1], rgb_row[x * 3 + 2]);
+            }
+
+            VNC_WritePixels(surface, r->x, r->y + y, r->w, 1, pixels, NULL);
+        }
+
+        SDL_free(rgb_row);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+}
+
+int VNC_TightJpegFromServer(VNC_Connection *vnc, VNC_RectangleHeader *header) {
+    size_t size;
+
+    if (VNC_TightCompactLength(vnc, &size)) {
+        return -1;
+    }
+
+    VNC_TightJpegRect *rect = SDL_malloc(sizeof (VNC_TightJpegRect) + size);
+    if (!rect) {
+        return VNC_OutOfMemory(vnc);
+    }
+
+    rect->size = size;
+    rect->data = (Uint8 *) (rect + 1);
+
+    if (VNC_FromServer(vnc, rect->data, size) != size) {
+        SDL_free(rect);
+        return -1;
+    }
+
+    /*
+     * JPEG rectangles share no decoder state, so any number of them can be
+     * decoded at once by the decode threads.
+     */
+    rect->job.run = VNC_TightJpegDecodeJob;
+    rect->job.vnc = vnc;
+    rect->job.r = header->r;
+    rect->job.chain = -1;
+
+    VNC_SubmitDecodeJob(vnc->decoder, &rect->job, NULL);
+
+    return 0;
+}
+
+int VNC_TightFromServer(VNC_Connection *vnc, VNC_RectangleHeader *header) {
+    VNC_PixelFormat *fmt = &vnc->server_details.fmt;
+    uint tpixel = VNC_TPixelSize(fmt);
+    Uint8 control;
+
+    if (VNC_FromServer(vnc, &control, 1) != 1) {
+        return -1;
+    }
+
+    for (int i = 0; i < VNC_DECODE_CHAINS; i++) {
+        if (control & (1 << i)) {
+            VNC_WaitForDecodeChain(vnc->decoder, i);
+            VNC_ResetZlibStream(vnc->tight_streams[i]);
+        }
+    }
+
+    control >>= 4;
+
+    if (control == VNC_TIGHT_FILL) {
+        return VNC_TightFillFromServer(vnc, header);
+    }
+
+    if (control == VNC_TIGHT_JPEG) {
+        return VNC_TightJpegFromServer(vnc, header);
+    }
+
+    if (control > VNC_TIGHT_FILL) {
+        warn("unsupported Tight compression type %u\n", control);
+        return -1;
+    }
+
+    VNC_TightRect rect;
+    rect.job.r = header->r;
+    rect.filter = TIGHT_FILTER_COPY;
+    rect.palette_size = 0;
+    rect.stream = control & 0x03;
+
+    if (control & VNC_TIGHT_EXPLICIT_FILTER) {
+        Uint8 filter;
+        if (VNC_FromServer(vnc, &filter, 1) != 1) {
+            return -1;
+        }
+
+        rect.filter = filter;
+    }
+
+    size_t row_size = header->r.w * tpixel;
+
+    switch (rect.filter) {
+        case TIGHT_FILTER_COPY:
+        case TIGHT_FILTER_GRADIENT:
+            break;
+
+        case TIGHT_FILTER_PALETTE: {
+            Uint8 colors;
+            if (VNC_FromServer(vnc, &colors, 1) != 1) {
+                return -1;
+            }
+
+            rect.palette_size = colors + 1;
+            if (VNC_ServerToBuffer(vnc, rect.palette_size * tpixel) <= 0) {
+                return -1;
+            }
+
+            Uint8 *p = vnc->buffer.data;
+            for (uint i = 0; i < rect.palette_size; i++, p += tpixel) {
+                rect.palette[i] = VNC_TPixel(fmt, p);
+            }
+
+            row_size = rect.palette_size == 2 ?
+                (header->r.w + 7) / 8 : header->r.w;
+            break;
+        }
+
+        default:
+            warn("unknown Tight filter %u\n", rect.filter);
+            return -1;
+    }
+
+    rect.raw_size = row_size * header->r.h;
+
+    if (rect.raw_size < VNC_TIGHT_MIN_TO_COMPRESS) {
+        if (VNC_ServerToBuffer(vnc, rect.raw_size) != rect.raw_size) {
+            return -1;
+        }
+
+        VNC_WaitForDecodeJobs(vnc->decoder, &header->r);
+        return VNC_TightFilterToSurface(vnc, &rect, vnc->buffer.data,
+                rect.raw_size);
+    }
+
+    if (VNC_TightCompactLength(vnc, &rect.data_size)) {
+        return -1;
+    }
+
+    /*
+     * Compressed data is handed to a decode thread along with the rectangle,
+     * so that rectangles using different zlib streams inflate in parallel.
+     */
+    VNC_TightRect *job = SDL_malloc(sizeof (VNC_TightRect) + rect.data_size);
+    if (!job) {
+        return VNC_OutOfMemory(vnc);
+    }
+
+    *job = rect;
+    job->data = (Uint8 *) (job + 1);
+
+    if (VNC_FromServer(vnc, job->data, job->data_size) != job->data_size) {
+        SDL_free(job);
+        return -1;
+    }
+
+    job->job.run = VNC_TightDecodeJob;
+    job->job.vnc = vnc;
+    job->job.chain = job->stream;
+
+    VNC_SubmitDecodeJob(vnc->decoder, &job->job, NULL);
+
+    return 0;
+}
+
+/*
+ * Decodes an RRE or, if compact is set, a CoRRE rectangle.
+ *
+ * CoRRE differs from RRE only in sending subrectangle positions and sizes as
+ * single bytes rather than 16-bit values.
+ */
+int VNC_DecodeRRERect(VNC_Connection *vnc, SDL_Rect *r, VNC_ByteReader *reader,
+        SDL_bool compact) {
+
+    VNC_PixelFormat *fmt = &vnc->server_details.fmt;
+    uint bytes_pp = fmt->bpp / 8;
+    size_t subrect_size = bytes_pp + (compact ? 4 : 8);
+
+    if (!VNC_RectInSurface(vnc->surface, r)) {
+        warn("RRE rectangle lies outside of the framebuffer\n");
+        return -1;
+    }
+
+    Uint8 *head = VNC_ReadBytes(reader, 4 + bytes_pp);
+    if (!head) {
+        return -1;
+    }
+
+    Uint32 count = (Uint32) head[0] << 24 | head[1] << 16 | head[2] << 8 |
+        head[3];
+    Uint32 bg = VNC_MapPixel(vnc,
+            VNC_PixelFromBytes(head + 4, bytes_pp, fmt->is_big_endian));
+
+    Uint8 *p = VNC_ReadBytes(reader, (size_t) count * subrect_size);
+    if (!p) {
+        return -1;
+    }
+
+    VNC_FillRect(vnc->surface, r->x, r->y, r->w, r->h, bg);
+
+    for (Uint32 i = 0; i < count; i++, p += subrect_size) {
+        Uint32 color = VNC_MapPixel(vnc,
+                VNC_PixelFromBytes(p, bytes_pp, fmt->is_big_endian));
+        Uint8 *geometry = p + bytes_pp;
+        int x, y, w, h;
+
+        if (compact) {
+            x = geometry[0];
+            y = geometry[1];
+            w = geometry[2];
+            h = geometry[3];
+
+        } else {
+            x = geometry[0] << 8 | geometry[1];
+            y = geometry[2] << 8 | geometry[3];
+            w = geometry[4] << 8 | geometry[5];
+            h = geometry[6] << 8 | geometry[7];
+        }
+
+        if (x + w > r->w || y + h > r->h) {
+            warn("RRE subrectangle lies outside of its rectangle\n");
+            return -1;
+        }
+
+        VNC_FillRect(vnc->surface, r->x + x, r->y + y, w, h, color);
+    }
+
+    return 0;
+}
+
+int VNC_DecodeRRE(VNC_Connection *vnc, SDL_Rect *r, VNC_ByteReader *reader) {
+    return VNC_DecodeRRERect(vnc, r, reader, SDL_FALSE);
+}
+
+int VNC_DecodeCoRRE(VNC_Connection *vnc, SDL_Rect *r, VNC_ByteReader *reader) {
+    return VNC_DecodeRRERect(vnc, r, reader, SDL_TRUE);
+}
+
+/*
+ * Hextile subencoding flags, and the size of Hextile tiles.
+ */
+#define VNC_HEXTILE_RAW 0x01
+#define VNC_HEXTILE_BACKGROUND 0x02
+#define VNC_HEXTILE_FOREGROUND 0x04
+#define VNC_HEXTILE_ANY_SUBRECTS 0x08
+#define VNC_HEXTILE_SUBRECTS_COLORED 0x10
+#define VNC_HEXTILE_TILE_SIZE 16
+
+int VNC_HextileTile(VNC_Connection *vnc, VNC_ByteReader *reader,
+        SDL_Rect *tile, Uint32 *bg, Uint32 *fg) {
+
+    VNC_PixelFormat *fmt = &vnc->server_details.fmt;
+    uint bytes_pp = fmt->bpp / 8;
+
+    Uint8 *subencoding = VNC_ReadBytes(reader, 1);
+    if (!subencoding) {
+        return -1;
+    }
+
+    Uint8 sub = *subencoding;
+
+    if (sub & VNC_HEXTILE_RAW) {
+        Uint32 pixels[VNC_HEXTILE_TILE_SIZE * VNC_HEXTILE_TILE_SIZE];
+        int n = tile->w * tile->h;
+
+        Uint8 *p = VNC_ReadBytes(reader, n * bytes_pp);
+        if (!p) {
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++, p += bytes_pp) {
+            pixels[i] = VNC_PixelFromBytes(p, bytes_pp, fmt->is_big_endian);
+        }
+
+        VNC_WritePixels(vnc->surface, tile->x, tile->y, tile->w, tile->h,
+                pixels, vnc->pixel_lut);
+        return 0;
+    }
+
+    /*
+     * Everything up to the subrectangle data: the background and foreground
+     * pixels and the subrectangle count.
+     */
+    size_t head_size = 0;
+    head_size += (sub & VNC_HEXTILE_BACKGROUND) ? bytes_pp : 0;
+    head_size += (sub & VNC_HEXTILE_FOREGROUND) ? bytes_pp : 0;
+    head_size += (sub & VNC_HEXTILE_ANY_SUBRECTS) ? 1 : 0;
+
+    Uint8 *p = VNC_ReadBytes(reader, head_size);
+    if (!p) {
+        return -1;
+    }
+
+    if (sub & VNC_HEXTILE_BACKGROUND) {
+        *bg = VNC_MapPixel(vnc,
+                VNC_PixelFromBytes(p, bytes_pp, fmt->is_big_endian));
+        p += bytes_pp;
+    }
+
+    if (sub & VNC_HEXTILE_FOREGROUND) {
+        *fg = VNC_MapPixel(vnc,
+                VNC_PixelFromBytes(p, bytes_pp, fmt->is_big_endian));
+        p += bytes_pp;
+    }
+
+    VNC_FillRect(vnc->surface, tile->x, tile->y, tile->w, tile->h, *bg);
+
+    if (!(sub & VNC_HEXTILE_ANY_SUBRECTS)) {
+        return 0;
+    }
+
+    uint count = *p;
+    SDL_bool colored = (sub & VNC_HEXTILE_SUBRECTS_COLORED) != 0;
+    size_t subrect_size = 2 + (colored ? bytes_pp : 0);
+
+    p = VNC_ReadBytes(reader, count * subrect_size);
+    if (!p) {
+        return -1;
+    }
+
+    Uint32 color = *fg;
+
+    for (uint i = 0; i < count; i++) {
+        if (colored) {
+            color = VNC_MapPixel(vnc,
+                    VNC_PixelFromBytes(p, bytes_pp, fmt->is_big_endian));
+            p += bytes_pp;
+        }
+
+        int x = p[0] >> 4;
+        int y = p[0] & 0x0f;
+        int w = (p[1] >> 4) + 1;
+        int h = (p[1] & 0x0f) + 1;
+        p += 2;
+
+        if (x + w > tile->w || y + h > tile->h) {
+            warn("Hextile subrectangle lies outside of its tile\n");
+            return -1;
+        }
+
+        VNC_FillRect(vnc->surface, tile->x + x, tile->y + y, w, h, color);
+    }
+
+    return 0;
+}
+
+int VNC_DecodeHextile(VNC_Connection *vnc, SDL_Rect *r,
+        VNC_ByteReader *reader) {
+
+    Uint32 bg = 0;
+    Uint32 fg = 0;
+
+    if (!VNC_RectInSurface(vnc->surface, r)) {
+        warn("Hextile rectangle lies outside of the framebuffer\n");
+        return -1;
+    }
+
+    if (SDL_MUSTLOCK(vnc->surface)) {
+        SDL_LockSurface(vnc->surface);
+    }
+
+    int res = 0;
+
+    for (int y = 0; y < r->h && !res; y += VNC_HEXTILE_TILE_SIZE) {
+        for (int x = 0; x < r->w && !res; x += VNC_HEXTILE_TILE_SIZE) {
+            SDL_Rect tile;
+            tile.x = r->x + x;
+            tile.y = r->y + y;
+            tile.w = SDL_min(VNC_HEXTILE_TILE_SIZE, r->w - x);
+            tile.h = SDL_min(VNC_HEXTILE_TILE_SIZE, r->h - y);
+
+            res = VNC_HextileTile(vnc, reader, &tile, &bg, &fg);
+        }
+    }
+
+    if (SDL_MUSTLOCK(vnc->surface)) {
+        SDL_UnlockSurface(vnc->surface);
+    }
+
+    return res;
+}
+
+/*
+ * Decodes a rectangle of an encoding that keeps no state between rectangles,
+ * from its data in the receive buffer.
+ */
+int VNC_DecodeBufferedRect(VNC_Connection *vnc, VNC_RectangleHeader *header,
+        VNC_RectDecoder decode) {
+
+    VNC_ReceiveBuffer *rb = &vnc->recv_buffer;
+
+    return VNC_DecodeRectInParallel(vnc, &header->r, decode,
+            rb->data + rb->start, vnc->parser->length);
+}
+
+/*
+ * Decodes a rectangle whose data is all in the receive buffer.
+ *
+ * Rectangles are decoded by the decode threads where that pays off, each as
+ * soon as the rectangles before it that it overlaps, or copies from, have
+ * been; only the end of the update waits for them all.
+ */
+int VNC_HandleRectangle(VNC_Connection *vnc, VNC_RectangleHeader *header) {
+    int res;
+
+    switch (header->e) {
+        case RAW:
+            /* raw rectangles are written by the parser, so never get here */
+            return -1;
+
+        case COPY_RECT:
+            res = VNC_CopyRectFromServer(vnc, header);
+            break;
+
+        case RRE:
+            res = VNC_DecodeBufferedRect(vnc, header, VNC_DecodeRRE);
+            break;
+
+        case CORRE:
+            res = VNC_DecodeBufferedRect(vnc, header, VNC_DecodeCoRRE);
+            break;
+
+        case HEXTILE:
+            res = VNC_DecodeBufferedRect(vnc, header, VNC_DecodeHextile);
+            break;
+
+        case TIGHT:
+            res = VNC_TightFromServer(vnc, header);
+            break;
+
+        case TRLE:
+            res = VNC_TRLEFromServer(vnc, header);
+            break;
+
+        case ZRLE:
+            res = VNC_ZRLEFromServer(vnc, header);
+            break;
+
+        case PSEUDO_DESKTOP_SIZE:
+            /* damages the whole of the resized surface */
+            return VNC_DesktopSizeFromServer(vnc, header);
+
+        default:
+            /* unknown encodings cannot be measured, so never get this far */
+            return -1;
+    }
+
+    /*
+     * Every other encoding writes the whole rectangle, whether on this thread
+     * or in a decode job that is waited for before the update's damage is
+     * published.
+     */
+    VNC_AddDamage(vnc, &header->r);
+
+    return res;
+}
+
+/*
+ * Counts a framebuffer update towards the rate at which updates are achieved,
+ * which is measured over periods of about a second.
+ */
+void VNC_MeasureUpdateRate(VNC_Connection *vnc) {
+    VNC_ConnectionStats *stats = &vnc->stats;
+    Uint64 now = VNC_Now();
+
+    stats->updates++;
+
+    if (!stats->rate_start) {
+        stats->rate_start = now;
+        stats->rate_updates = stats->updates;
+        return;
+    }
+
+    if (now - stats->rate_start >= VNC_NS_PER_SECOND) {
+        stats->update_rate = (double) (stats->updates - stats->rate_updates) *
+            VNC_NS_PER_SECOND / (now - stats->rate_start);
+        stats->rate_start = now;
+        stats->rate_updates = stats->updates;
+    }
+}
+
+/*
+ * Folds the size of a framebuffer update and the time it took to arrive into
+ * the connection's throughput estimate and average update size.
+ */
+void VNC_MeasureUpdate(VNC_Connection *vnc, Uint64 bytes, Uint64 ns) {
+    VNC_SampleThroughput(vnc, bytes, ns);
+
+    VNC_MeasureUpdateRate(vnc);
+
+    VNC_UpdateRequests *req = &vnc->requests;
+
+    if (req->update_bytes) {
+        req->update_bytes = 0.75 * req->update_bytes + 0.25 * bytes;
+    } else {
+        req->update_bytes = bytes;
+    }
+}
+
+int VNC_FramebufferUpdateRequest(VNC_Connection *vnc, SDL_bool incremental,
+        Uint16 x, Uint16 y, Uint16 w, Uint16 h) {
+
+    debug("sending framebuffer update request\n");
+
+    char msg[10];
+
+    Uint8 *msg_as_8b = (Uint8 *) msg;
+    *msg_as_8b++ = 3;
+    *msg_as_8b++ = incremental;
+
+    Uint16 *msg_as_16b = (Uint16 *) msg_as_8b;
+    *msg_as_16b++ = SDL_SwapBE16(x);
+    *msg_as_16b++ = SDL_SwapBE16(y);
+    *msg_as_16b++ = SDL_SwapBE16(w);
+    *msg_as_16b++ = SDL_SwapBE16(h);
+
+    return VNC_SendToServer(vnc, msg, 10);
+}
+
+/*
+ * Requests an update of the whole framebuffer, keeping track of the request
+ * if the server is being polled for updates.
+ */
+int VNC_SendUpdateRequest(VNC_Connection *vnc, SDL_bool incremental) {
+    VNC_UpdateRequests *req = &vnc->requests;
+
+    if (VNC_FramebufferUpdateRequest(vnc, incremental, 0, 0,
+                vnc->server_details.w, vnc->server_details.h) < 0) {
+        return -1;
+    }
+
+    if (vnc->continuous_updates) {
+        return 0;
+    }
+
+    /* long since merged into an update, if there are this many */
+    if (req->in_flight == VNC_MAX_UPDATE_REQUESTS) {
+        req->first = (req->first + 1) % VNC_MAX_UPDATE_REQUESTS;
+        req->in_flight--;
+    }
+
+    req->sent[(req->first + req->in_flight) % VNC_MAX_UPDATE_REQUESTS] =
+        VNC_Now();
+    req->in_flight++;
+    req->settled = SDL_FALSE;
+
+    return 0;
+}
+
+/*
+ * Sizes the request window to cover the round-trip time at the polling rate,
+ * unless fewer updates than that already fill the link.
+ */
+void VNC_AdaptRequestWindow(VNC_Connection *vnc) {
+    VNC_UpdateRequests *req = &vnc->requests;
+    double rtt = vnc->stats.rtt;
+    double updates = rtt * vnc->fps;
+
+    if (vnc->stats.throughput && req->update_bytes) {
+        updates = SDL_min(updates,
+                vnc->stats.throughput * rtt / req->update_bytes);
+    }
+
+    unsigned max = SDL_max(1, SDL_min(req->max_window,
+                VNC_MAX_UPDATE_REQUESTS));
+    updates = SDL_min(updates, VNC_MAX_UPDATE_REQUESTS);
+
+    req->window = SDL_min(max, 1 + (unsigned) updates);
+}
+
+/*
+ * Accounts for a framebuffer update arriving while polling the server.
+ *
+ * The update answers the oldest request in flight, and with it any other
+ * request that reached the server before the update left it, as servers merge
+ * the requests they have not answered yet into their next update. The time
+ * the oldest request took to answer is sampled as a round-trip time; as that
+ * includes however long the server waited for the framebuffer to change, the
+ * smallest recent sample is taken as the estimate.
+ */
+void VNC_RequestAnswered(VNC_Connection *vnc, Uint64 arrived) {
+    VNC_UpdateRequests *req = &vnc->requests;
+
+    if (!req->in_flight) {
+        return;
+    }
+
+    req->rtt_samples[req->rtt_count++ % VNC_RTT_SAMPLES] =
+        arrived - req->sent[req->first];
+
+    Uint64 rtt = req->rtt_samples[0];
+    for (unsigned i = 1; i < SDL_min(req->rtt_count, VNC_RTT_SAMPLES); i++) {
+        rtt = SDL_min(rtt, req->rtt_samples[i]);
+    }
+
+    vnc->stats.rtt = (double) rtt / VNC_NS_PER_SECOND;
+
+    req->settled = req->in_flight == 1;
+
+    do {
+        req->first = (req->first + 1) % VNC_MAX_UPDATE_REQUESTS;
+        req->in_flight--;
+    } while (req->in_flight && req->sent[req->first] + rtt <= arrived);
+
+    VNC_AdaptRequestWindow(vnc);
+}
+
+/*
+ * Changes pixel format once the requests held back by VNC_UpdatePixelFormat
+ * have drained, and resumes polling.
+ */
+int VNC_FinishDrain(VNC_Connection *vnc) {
+    VNC_UpdateRequests *req = &vnc->requests;
+
+    req->draining = SDL_FALSE;
+    req->in_flight = 0;
+    req->settled = SDL_TRUE;
+
+    int res = VNC_UpdatePixelFormat(vnc);
+
+    if (res > 0) {
+        res = VNC_SendUpdateRequest(vnc, SDL_FALSE);
+    }
+
+    return res < 0 ? -1 : 0;
+}
+
+/*
+ * Moves the deadline for the next update request on by one polling period.
+ *
+ * Deadlines lie on a fixed grid, so that time spent decoding does not push
+ * later requests back and the request rate does not drift. When the polling
+ * thread is more than a period behind, the deadlines it missed are skipped
+ * rather than caught up on with a burst of requests.
+ */
+void VNC_AdvanceDeadline(VNC_Connection *vnc, Uint64 now) {
+    VNC_UpdateRequests *req = &vnc->requests;
+    Uint64 period = VNC_NS_PER_SECOND / vnc->fps;
+
+    if (!req->deadline) {
+        req->deadline = now;
+    }
+
+    req->deadline += period;
+
+    if (req->deadline <= now) {
+        Uint64 missed = (now - req->deadline) / period + 1;
+
+        vnc->stats.skipped_deadlines += missed;
+        req->deadline += missed * period;
+    }
+}
+
+/*
+ * Sends whatever update requests have fallen due while polling the server: up
+ * to one per polling period as their deadlines come, for as long as fewer than
+ * the request window are in flight.
+ *
+ * Returns 0 on success, with due set to when something next falls due, or to 0
+ * if nothing will until more data arrives; returns -1 on error.
+ */
+int VNC_SendDueRequests(VNC_Connection *vnc, Uint64 *due) {
+    VNC_UpdateRequests *req = &vnc->requests;
+
+    for (;;) {
+        Uint64 now = VNC_Now();
+        *due = 0;
+
+        if (vnc->continuous_updates) {
+            /* the server sends updates unasked */
+
+        } else if (req->draining) {
+            /*
+             * Once nothing has arrived for long enough that anything the
+             * server had sent would have, it owes nothing in the old format.
+             * The rest of a message that has started to arrive is waited for
+             * regardless.
+             */
+            if (VNC_ParserIdle(vnc)) {
+                *due = req->last_message +
+                    2 * vnc->stats.rtt * VNC_NS_PER_SECOND +
+                    VNC_NS_PER_SECOND / 10;
+            }
+
+            if (*due && now >= *due) {
+                if (VNC_FinishDrain(vnc)) {
+                    return -1;
+                }
+
+                continue;
+            }
+
+        } else if (req->in_flight < req->window) {
+            /* when behind, no time is spent waiting */
+            *due = SDL_max(req->deadline, 1);
+
+            if (now >= *due) {
+                if (VNC_SendUpdateRequest(vnc, SDL_TRUE)) {
+                    return -1;
+                }
+
+                VNC_AdvanceDeadline(vnc, now);
+                continue;
+            }
+        }
+
+        return 0;
+    }
+}
+
+/*
+ * Waits until more data from the server can be received, sending update
+ * requests meanwhile as they fall due.
+ *
+ * Returns 0 once data can be received, and -1 on error.
+ */
+int VNC_WaitForMessage(VNC_Connection *vnc) {
+    for (;;) {
+        Uint64 due;
+
+        if (VNC_SendDueRequests(vnc, &due)) {
+            return -1;
+        }
+
+        int res = VNC_WaitForServer(vnc, due);
+
+        if (res) {
+            return res < 0 ? -1 : 0;
+        }
+    }
+}
+
+/*
+ * Has the server push framebuffer updates as the framebuffer changes, once it
+ * has announced that it supports both continuous updates and fences; the
+ * latter are needed to tell where it switches pixel formats.
+ */
+int VNC_EnableContinuousUpdates(VNC_Connection *vnc) {
+    if (vnc->continuous_updates || !vnc->supports_continuous_updates ||
+            !vnc->supports_fence) {
+        return 0;
+    }
+
+    if (VNC_SendEnableContinuousUpdates(vnc, SDL_TRUE) < 0) {
+        return -1;
+    }
+
+    debug("enabled continuous updates\n");
+    vnc->continuous_updates = SDL_TRUE;
+    vnc->requests.in_flight = 0;
+    vnc->requests.draining = SDL_FALSE;
+
+    return 0;
+}
+
+/*
+ * Handles an EndOfContinuousUpdates message, which the server sends both to
+ * announce support for continuous updates and when it stops sending them.
+ *
+ * Returns 1 if continuous updates stopped, so that updates need requesting
+ * again, 0 if they did not, and -1 on error.
+ */
+int VNC_EndOfContinuousUpdates(VNC_Connection *vnc) {
+    if (vnc->continuous_updates) {
+        debug("server ended continuous updates\n");
+        vnc->continuous_updates = SDL_FALSE;
+        return 1;
+    }
+
+    vnc->supports_continuous_updates = SDL_TRUE;
+
+    return VNC_EnableContinuousUpdates(vnc);
+}
+
+/*
+ * Handles a Fence message. The server's requests are answered straight away:
+ * every message before the fence has been fully processed by then, and none
+ * after it has been read yet, which satisfies all of the flags. The server
+ * uses how quickly they are answered to keep from sending updates faster than
+ * they are decoded.
+ *
+ * Returns 1 if the connection switched pixel formats, so that the whole
+ * framebuffer needs requesting again, 0 if it did not, and -1 on error.
+ */
+int VNC_FenceFromServer(VNC_Connection *vnc) {
+    Uint8 header[8];
+    Uint8 payload[VNC_FENCE_MAX_PAYLOAD];
+
+    if (VNC_FromServer(vnc, header, sizeof (header)) < (int) sizeof (header)) {
+        return -1;
+    }
+
+    Uint32 flags;
+    SDL_memcpy(&flags, &header[3], 4);
+    flags = SDL_SwapBE32(flags);
+
+    Uint8 length = header[7];
+
+    if (length > VNC_FENCE_MAX_PAYLOAD) {
+        warn("fence payload of %u bytes too long\n", length);
+        return -1;
+    }
+
+    if (VNC_FromServer(vnc, payload, length) < length) {
+        return -1;
+    }
+
+    if (flags & VNC_FENCE_REQUEST) {
+        if (VNC_SendFence(vnc, flags & VNC_FENCE_FLAGS, payload, length) < 0) {
+            return -1;
+        }
+
+        vnc->supports_fence = SDL_TRUE;
+
+        return VNC_EnableContinuousUpdates(vnc);
+    }
+
+    if (vnc->syncing_pixel_format && length == 1 &&
+            payload[0] == VNC_FENCE_PIXEL_FORMAT) {
+        return VNC_FinishPixelFormatSync(vnc);
+    }
+
+    return 0;
+}
+
+int VNC_ResizeColorMap(VNC_ColorMap *color_map, size_t n) {
+    color_map->data = realloc(color_map->data, n * sizeof (VNC_ColorMapEntry));
+
+    return !color_map->data;
+}
+
+int VNC_AssureColourMapSize(VNC_ColorMap *color_map, size_t n) {
+    if (color_map->size < n) {
+        return VNC_ResizeColorMap(color_map, n);
+    }
+
+    return 0;
+}
+
+int VNC_SetColorMapEntries(VNC_Connection *vnc) {
+    VNC_ServerToBuffer(vnc, 5);
+
+    Uint8 *buf = vnc->buffer.data;
+    uint first_color_index = buf[1] << 8 | buf[2];
+    uint number_of_colors = buf[3] << 8 | buf[4];
+    uint color_index_end = first_color_index + number_of_colors;
+
+    debug("updating colors %u-%u in color map\n", first_color_index,
+            color_index_end - 1);
+
+    VNC_AssureColourMapSize(&vnc->color_map, color_index_end);
+
+    VNC_ServerToBuffer(vnc, number_of_colors * 6);
+    Uint16 *colors = (Uint16 *) vnc->buffer.data;
+
+    for (uint i = first_color_index; i < color_index_end; i++) {
+        vnc->color_map.data[i].r = SDL_SwapBE16(*colors++);
+        vnc->color_map.data[i].g = SDL_SwapBE16(*colors++);
+        vnc->color_map.data[i].b = SDL_SwapBE16(*colors++);
+    }
+
+    return 0;
+}
+
+VNC_Parser *VNC_CreateParser(void) {
+    VNC_Parser *parser = SDL_calloc(1, sizeof (VNC_Parser));
+    if (!parser) {
+        return NULL;
+    }
+
+    parser->state = VNC_PARSE_MESSAGE_TYPE;
+    parser->error = VNC_ERROR_SERVER_DISCONNECT;
+
+    return parser;
+}
+
+/*
+ * Checks whether the n bytes after those of the message or rectangle being
+ * parsed measured so far are buffered, noting how many bytes are needed if
+ * they are not.
+ */
+SDL_bool VNC_Buffered(VNC_Parser *parser, size_t avail, size_t n) {
+    if (parser->length + n > avail) {
+        parser->need = parser->length + n;
+        return SDL_FALSE;
+    }
+
+    return SDL_TRUE;
+}
+
+/*
+ * Counts n more bytes as part of the message or rectangle being parsed if
+ * they are buffered.
+ */
+SDL_bool VNC_Measure(VNC_Parser *parser, size_t avail, size_t n) {
+    if (!VNC_Buffered(parser, avail, n)) {
+        return SDL_FALSE;
+    }
+
+    parser->length += n;
+
+    return SDL_TRUE;
+}
+
+/*
+ * Rejects the message or rectangle being parsed as malformed.
+ */
+int VNC_RejectMalformed(VNC_Parser *parser) {
+    parser->error = VNC_ERROR_MALFORMED_DATA;
+    return -1;
+}
+
+/*
+ * Upper bound on the length of n bytes once deflated by the server, including
+ * the zlib header and the flush that ends every rectangle.
+ *
+ * Lengths are taken from the server before the data they announce has
+ * arrived, and are buffered in full; anything longer than this cannot be
+ * genuine, and is rejected rather than allocated for.
+ */
+size_t VNC_DeflateBound(size_t n) {
+    return n + (n >> 12) + (n >> 14) + (n >> 25) + 64;
+}
+
+/*
+ * Measures data of a fixed size.
+ *
+ * Like the other measuring functions, returns 1 once the whole of the message
+ * or rectangle being parsed is buffered, 0 if more of it is needed, and -1 if
+ * it is malformed.
+ */
+int VNC_MeasureFixed(VNC_Parser *parser, size_t avail, size_t n) {
+    parser->length = 0;
+
+    return VNC_Measure(parser, avail, n);
+}
+
+/*
+ * Measures data preceded by its length in Tight's compact representation,
+ * which must not exceed max.
+ */
+int VNC_MeasureCompactData(VNC_Parser *parser, Uint8 *data, size_t avail,
+        size_t max) {
+    size_t length = 0;
+
+    for (int i = 0; i < 3; i++) {
+        if (!VNC_Measure(parser, avail, 1)) {
+            return 0;
+        }
+
+        Uint8 b = data[parser->length - 1];
+        length |= (size_t) (i < 2 ? b & 0x7f : b) << (7 * i);
+
+        if (!(b & 0x80)) {
+            break;
+        }
+    }
+
+    if (length > max) {
+        warn("Tight data of %zu bytes is too long for its rectangle\n", length);
+        return VNC_RejectMalformed(parser);
+    }
+
+    return VNC_Measure(parser, avail, length);
+}
+
+int VNC_MeasureRRE(VNC_Connection *vnc, Uint8 *data, size_t avail,
+        SDL_bool compact) {
+
+    VNC_Parser *parser = vnc->parser;
+    uint bytes_pp = vnc->server_details.fmt.bpp / 8;
+
+    if (!VNC_MeasureFixed(parser, avail, 4 + bytes_pp)) {
+        return 0;
+    }
+
+    Uint32 count = (Uint32) data[0] << 24 | data[1] << 16 | data[2] << 8 |
+        data[3];
+    SDL_Rect *r = &parser->header.r;
+
+    /* subrectangles beyond one per pixel could only overlap in full */
+    if (count > (Uint64) r->w * r->h) {
+        warn("RRE rectangle has more subrectangles than pixels\n");
+        return VNC_RejectMalformed(parser);
+    }
+
+    return VNC_Measure(parser, avail,
+            (size_t) count * (bytes_pp + (compact ? 4 : 8)));
+}
+
+int VNC_MeasureZRLE(VNC_Connection *vnc, Uint8 *data, size_t avail) {
+    VNC_Parser *parser = vnc->parser;
+    SDL_Rect *r = &parser->header.r;
+    size_t cpixel = VNC_CPixelSize(&vnc->server_details.fmt);
+
+    if (!VNC_MeasureFixed(parser, avail, 4)) {
+        return 0;
+    }
+
+    Uint32 length = (Uint32) data[0] << 24 | data[1] << 16 | data[2] << 8 |
+        data[3];
+
+    /*
+     * No tile takes more than a subencoding byte and a full palette, followed
+     * by a run length byte after every pixel.
+     */
+    size_t tiles = (size_t) ((r->w + VNC_ZRLE_TILE_SIZE - 1) /
+            VNC_ZRLE_TILE_SIZE) * ((r->h + VNC_ZRLE_TILE_SIZE - 1) /
+            VNC_ZRLE_TILE_SIZE);
+    size_t max = (size_t) r->w * r->h * (cpixel + 1) +
+        tiles * (1 + 127 * cpixel);
+
+    if (length > VNC_DeflateBound(max)) {
+        warn("ZRLE data of %u bytes is too long for its rectangle\n", length);
+        return VNC_RejectMalformed(parser);
+    }
+
+    return VNC_Measure(parser, avail, length);
+}
+
+int VNC_MeasureTight(VNC_Connection *vnc, Uint8 *data, size_t avail) {
+    VNC_Parser *parser = vnc->parser;
+    SDL_Rect *r = &parser->header.r;
+    uint tpixel = VNC_TPixelSize(&vnc->server_details.fmt);
+
+    if (!VNC_MeasureFixed(parser, avail, 1)) {
+        return 0;
+    }
+
+    Uint8 control = data[0] >> 4;
+
+    if (control == VNC_TIGHT_FILL) {
+        return VNC_Measure(parser, avail, tpixel);
+    }
+
+    if (control == VNC_TIGHT_JPEG) {
+        /* the most baseline JPEG can take: 6 bytes a pixel over whole blocks */
+        size_t max = (size_t) ((r->w + 15) & ~15) * ((r->h + 15) & ~15) * 6 +
+            2048;
+
+        return VNC_MeasureCompactData(parser, data, avail, max);
+    }
+
+    if (control > VNC_TIGHT_FILL) {
+        warn("unsupported Tight compression type %u\n", control);
+        return VNC_RejectMalformed(parser);
+    }
+
+    Uint8 filter = TIGHT_FILTER_COPY;
+
+    if (control & VNC_TIGHT_EXPLICIT_FILTER) {
+        if (!VNC_Measure(parser, avail, 1)) {
+            return 0;
+        }
+
+        filter = data[parser->length - 1];
+    }
+
+    size_t row_size = r->w * tpixel;
+
+    switch (filter) {
+        case TIGHT_FILTER_COPY:
+        case TIGHT_FILTER_GRADIENT:
+            break;
+
+        case TIGHT_FILTER_PALETTE: {
+            if (!VNC_Measure(parser, avail, 1)) {
+                return 0;
+            }
+
+            uint colors = data[parser->length - 1] + 1;
+
+            if (!VNC_Measure(parser, avail, colors * tpixel)) {
+                return 0;
+            }
+
+            row_size = colors == 2 ? (r->w + 7) / 8 : r->w;
+            break;
+        }
+
+        default:
+            warn("unknown Tight filter %u\n", filter);
+            return VNC_RejectMalformed(parser);
+    }
+
+    size_t raw_size = row_size * r->h;
+
+    if (raw_size < VNC_TIGHT_MIN_TO_COMPRESS) {
+        return VNC_Measure(parser, avail, raw_size);
+    }
+
+    return VNC_MeasureCompactData(parser, data, avail,
+            VNC_DeflateBound(raw_size));
+}
+
+/*
+ * Measures a Hextile rectangle tile by tile, picking up at the tile it had got
+ * to last time.
+ */
+int VNC_MeasureHextile(VNC_Connection *vnc, Uint8 *data, size_t avail) {
+    VNC_Parser *parser = vnc->parser;
+    SDL_Rect *r = &parser->header.r;
+    uint bytes_pp = vnc->server_details.fmt.bpp / 8;
+
+    int tiles_per_row =
+        (r->w + VNC_HEXTILE_TILE_SIZE - 1) / VNC_HEXTILE_TILE_SIZE;
+    int tile_count = tiles_per_row *
+        ((r->h + VNC_HEXTILE_TILE_SIZE - 1) / VNC_HEXTILE_TILE_SIZE);
+
+    for (; parser->tile < tile_count; parser->tile++) {
+        int x = parser->tile % tiles_per_row * VNC_HEXTILE_TILE_SIZE;
+        int y = parser->tile / tiles_per_row * VNC_HEXTILE_TILE_SIZE;
+        int w = SDL_min(VNC_HEXTILE_TILE_SIZE, r->w - x);
+        int h = SDL_min(VNC_HEXTILE_TILE_SIZE, r->h - y);
+
+        Uint8 *tile = data + parser->length;
+        size_t size = 1;
+
+        if (!VNC_Buffered(parser, avail, size)) {
+            return 0;
+        }
+
+        Uint8 sub = tile[0];
+
+        if (sub & VNC_HEXTILE_RAW) {
+            size += w * h * bytes_pp;
+
+        } else {
+            size += (sub & VNC_HEXTILE_BACKGROUND) ? bytes_pp : 0;
+            size += (sub & VNC_HEXTILE_FOREGROUND) ? bytes_pp : 0;
+
+            if (sub & VNC_HEXTILE_ANY_SUBRECTS) {
+                if (!VNC_Buffered(parser, avail, size + 1)) {
+                    return 0;
+                }
+
+                SDL_bool colored = (sub & VNC_HEXTILE_SUBRECTS_COLORED) != 0;
+                size += 1 + tile[size] * (2 + (colored ? bytes_pp : 0));
+            }
+        }
+
+        if (!VNC_Measure(parser, avail, size)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Measures a TRLE rectangle, picking up at the tile, and the run within it,
+ * that it had got to last time.
+ */
+int VNC_MeasureTRLE(VNC_Connection *vnc, Uint8 *data, size_t avail) {
+    VNC_Parser *parser = vnc->parser;
+    SDL_Rect *r = &parser->header.r;
+    uint cpixel = VNC_CPixelSize(&vnc->server_details.fmt);
+
+    int tiles_per_row = (r->w + VNC_TRLE_TILE_SIZE - 1) / VNC_TRLE_TILE_SIZE;
+    int tile_count = tiles_per_row *
+        ((r->h + VNC_TRLE_TILE_SIZE - 1) / VNC_TRLE_TILE_SIZE);
+
+    for (; parser->tile < tile_count; parser->tile++) {
+        int x = parser->tile % tiles_per_row * VNC_TRLE_TILE_SIZE;
+        int y = parser->tile / tiles_per_row * VNC_TRLE_TILE_SIZE;
+        int w = SDL_min(VNC_TRLE_TILE_SIZE, r->w - x);
+        int h = SDL_min(VNC_TRLE_TILE_SIZE, r->h - y);
+
+        if (!parser->in_tile) {
+            if (!VNC_Buffered(parser, avail, 1)) {
+                return 0;
+            }
+
+            Uint8 sub = data[parser->length];
+            Uint8 palette_size = parser->palette_size;
+            size_t size = 1;
+
+            if (sub == VNC_TRLE_REUSE_PACKED || sub == VNC_TRLE_REUSE_RLE) {
+                sub = sub == VNC_TRLE_REUSE_PACKED ? 2 : 130;
+
+            } else if ((sub >= 1 && sub <= 16) || sub >= 130) {
+                palette_size = sub & 0x7f;
+                size += palette_size * cpixel;
+
+            } else if (sub != 0 && sub != 128) {
+                warn("invalid TRLE subencoding %u\n", sub);
+                return VNC_RejectMalformed(parser);
+            }
+
+            if (!VNC_Measure(parser, avail, size)) {
+                return 0;
+            }
+
+            parser->tile_sub = sub;
+            parser->palette_size = palette_size;
+            parser->in_tile = SDL_TRUE;
+            parser->pixel = 0;
+        }
+
+        Uint8 sub = parser->tile_sub;
+        int n = w * h;
+
+        if (sub == 0) {
+            if (!VNC_Measure(parser, avail, n * cpixel)) {
+                return 0;
+            }
+
+        } else if (sub >= 2 && sub <= 16) {
+            uint palette_size = parser->palette_size;
+            uint bits = palette_size <= 2 ? 1 : palette_size <= 4 ? 2 : 4;
+
+            if (!VNC_Measure(parser, avail, (w * bits + 7) / 8 * h)) {
+                return 0;
+            }
+
+        } else if (sub == 128 || sub >= 130) {
+            /* runs are measured one at a time */
+            while (parser->pixel < n) {
+                Uint8 *p = data + parser->length;
+                size_t size = sub == 128 ? cpixel : 1;
+                int run = 1;
+
+                if (!VNC_Buffered(parser, avail, size)) {
+                    return 0;
+                }
+
+                if (sub == 128 || *p & 0x80) {
+                    Uint8 b;
+
+                    do {
+                        if (!VNC_Buffered(parser, avail, size + 1)) {
+                            return 0;
+                        }
+
+                        b = p[size++];
+                        run += b;
+                    } while (b == 255);
+                }
+
+                parser->length += size;
+                parser->pixel += run;
+            }
+        }
+
+        parser->in_tile = SDL_FALSE;
+    }
+
+    return 1;
+}
+
+/*
+ * Measures the rectangle being parsed, according to its encoding.
+ */
+int VNC_MeasureRect(VNC_Connection *vnc, Uint8 *data, size_t avail) {
+    VNC_Parser *parser = vnc->parser;
+    VNC_RectangleHeader *header = &parser->header;
+    SDL_Rect *r = &header->r;
+
+    /*
+     * Pixel data only ever covers part of the framebuffer, which bounds how
+     * much of it a rectangle can announce.
+     */
+    if (header->e != PSEUDO_DESKTOP_SIZE &&
+            (r->x + r->w > vnc->server_details.w ||
+             r->y + r->h > vnc->server_details.h)) {
+        warn("rectangle lies outside of the framebuffer\n");
+        return VNC_RejectMalformed(parser);
+    }
+
+    switch (header->e) {
+        case RAW:
+            return VNC_MeasureFixed(parser, avail, (size_t) header->r.h *
+                    header->r.w * (vnc->server_details.fmt.bpp / 8));
+
+        case COPY_RECT:
+            return VNC_MeasureFixed(parser, avail, 4);
+
+        case RRE:
+            return VNC_MeasureRRE(vnc, data, avail, SDL_FALSE);
+
+        case CORRE:
+            return VNC_MeasureRRE(vnc, data, avail, SDL_TRUE);
+
+        case HEXTILE:
+            return VNC_MeasureHextile(vnc, data, avail);
+
+        case TIGHT:
+            return VNC_MeasureTight(vnc, data, avail);
+
+        case TRLE:
+            return VNC_MeasureTRLE(vnc, data, avail);
+
+        case ZRLE:
+            return VNC_MeasureZRLE(vnc, data, avail);
+
+        case PSEUDO_DESKTOP_SIZE:
+            return VNC_MeasureFixed(parser, avail, 0);
+
+        default:
+            warn("unknown encoding method %i\n", header->e);
+            parser->error = VNC_ERROR_UNIMPLEMENTED;
+            return -1;
+    }
+}
+
+/*
+ * Follows up on a message from the server once it has been handled. After the
+ * color depth was raised, the whole framebuffer is asked for so that regions
+ * last sent at a lower depth do not linger; incremental requests are sent by
+ * VNC_WaitForMessage. A lowered depth needs no refresh, as the surface already
+ * holds the finer colors.
+ *
+ * Like the other parsing steps, returns 1 once done, 0 if more data is needed
+ * first, and -1 on error.
+ */
+int VNC_FinishMessage(VNC_Connection *vnc, int res) {
+    vnc->parser->state = VNC_PARSE_MESSAGE_TYPE;
+
+    if (res > 0 && VNC_SendUpdateRequest(vnc, SDL_FALSE) < 0) {
+        return -1;
+    }
+
+    return res < 0 ? -1 : 1;
+}
+
+/*
+ * Number of bytes received from the server that have been parsed.
+ */
+Uint64 VNC_BytesParsed(VNC_Connection *vnc) {
+    VNC_ReceiveBuffer *rb = &vnc->recv_buffer;
+
+    return vnc->stats.bytes_received - (rb->end - rb->start);
+}
+
+int VNC_FinishUpdate(VNC_Connection *vnc) {
+    VNC_Parser *parser = vnc->parser;
+
+    VNC_WaitForDecodeJobs(vnc->decoder, NULL);
+
+    if (VNC_PublishDamage(vnc)) {
+        return VNC_OutOfMemory(vnc);
+    }
+
+    VNC_MeasureUpdate(vnc, VNC_BytesParsed(vnc) - parser->update_bytes,
+            vnc->requests.last_message - parser->update_start);
+
+    /*
+     * Between updates is the only point at which the pixel format can be
+     * changed, and then only once the server is known not to be sending any
+     * more pixel data in the old format.
+     */
+    return VNC_FinishMessage(vnc, VNC_UpdatePixelFormat(vnc));
+}
+
+/*
+ * Moves on to the next rectangle of the update being parsed, or finishes the
+ * update if there are no more.
+ */
+int VNC_NextRect(VNC_Connection *vnc) {
+    VNC_Parser *parser = vnc->parser;
+
+    if (!parser->rects_left) {
+        return VNC_FinishUpdate(vnc);
+    }
+
+    parser->rects_left--;
+    parser->state = VNC_PARSE_RECT_HEADER;
+
+    return 1;
+}
+
+int VNC_ParseMessageType(VNC_Connection *vnc, Uint8 *data, size_t avail) {
+    VNC_Parser *parser = vnc->parser;
+
+    if (!VNC_MeasureFixed(parser, avail, 1)) {
+        return 0;
+    }
+
+    parser->message = data[0];
+    vnc->recv_buffer.start++;
+
+    switch (parser->message) {
+        case FRAME_BUFFER_UPDATE:
+            VNC_RequestAnswered(vnc, vnc->requests.last_message);
+
+            parser->update_bytes = VNC_BytesParsed(vnc);
+            parser->update_start = vnc->requests.last_message;
+            parser->state = VNC_PARSE_UPDATE_HEADER;
+            return 1;
+
+        case SET_COLOUR_MAP_ENTRIES:
+        case END_OF_CONTINUOUS_UPDATES:
+        case FENCE:
+            parser->state = VNC_PARSE_MESSAGE;
+            return 1;
+
+        //case BELL:
+        //    //server_bell(vnc);
+        //    break;
+
+        //case SERVER_CUT_TEXT:
+        //    //server_cut_text(vnc);
+        //    break;
+
+        default:
+            parser->error = VNC_ERROR_UNIMPLEMENTED;
+            return -1;
+    }
+}
+
+/*
+ * Parses a message other than a framebuffer update, handling it once it has
+ * arrived in full.
+ */
+int VNC_ParseMessage(VNC_Connection *vnc, Uint8 *data, size_t avail) {
+    VNC_Parser *parser = vnc->parser;
+    VNC_ReceiveBuffer *rb = &vnc->recv_buffer;
+    int res;
+
+    switch (parser->message) {
+        case SET_COLOUR_MAP_ENTRIES:
+            if (!VNC_MeasureFixed(parser, avail, 5) ||
+                    !VNC_Measure(parser, avail, (data[3] << 8 | data[4]) * 6)) {
+                return 0;
+            }
+            break;
+
+        case FENCE:
+            if (!VNC_MeasureFixed(parser, avail, 8) ||
+                    !VNC_Measure(parser, avail, data[7])) {
+                return 0;
+            }
+            break;
+
+        default:
+            parser->length = 0;
+            break;
+    }
+
+    size_t end = rb->start + parser->length;
+
+    switch (parser->message) {
+        case SET_COLOUR_MAP_ENTRIES:
+            VNC_SetColorMapEntries(vnc);
+            res = 0;
+            break;
+
+        case END_OF_CONTINUOUS_UPDATES:
+            res = VNC_EndOfContinuousUpdates(vnc);
+            break;
+
+        default:
+            res = VNC_FenceFromServer(vnc);
+            break;
+    }
+
+    rb->start = end;
+
+    return VNC_FinishMessage(vnc, res);
+}
+
+int VNC_ParseUpdateHeader(VNC_Connection *vnc, Uint8 *data, size_t avail) {
+    VNC_Parser *parser = vnc->parser;
+
+    if (!VNC_MeasureFixed(parser, avail, 3)) {
+        return 0;
+    }
+
+    parser->rects_left = data[1] << 8 | data[2];
+    vnc->recv_buffer.start += 3;
+
+    debug("receiving framebuffer update of %u rectangles\n",
+            parser->rects_left);
+
+    return VNC_NextRect(vnc);
+}
+
+int VNC_ParseRectHeader(VNC_Connection *vnc, Uint8 *data, size_t avail) {
+    VNC_Parser *parser = vnc->parser;
+    VNC_RectangleHeader *header = &parser->header;
+    SDL_Rect *r = &header->r;
+
+    if (!VNC_MeasureFixed(parser, avail, 12)) {
+        return 0;
+    }
+
+    r->x = data[0] << 8 | data[1];
+    r->y = data[2] << 8 | data[3];
+    r->w = data[4] << 8 | data[5];
+    r->h = data[6] << 8 | data[7];
+    header->e = (Sint32) ((Uint32) data[8] << 24 | data[9] << 16 |
+            data[10] << 8 | data[11]);
+
+    vnc->recv_buffer.start += 12;
+
+    parser->length = 0;
+    parser->tile = 0;
+    parser->in_tile = SDL_FALSE;
+    parser->palette_size = 0;
+
+    if (header->e == RAW) {
+        /* an empty raw rectangle has no pixels, wherever it lies */
+        if (!r->w || !r->h) {
+            return VNC_NextRect(vnc);
+        }
+
+        if (!VNC_RectInSurface(vnc->surface, r)) {
+            warn("raw rectangle lies outside of the framebuffer\n");
+            return VNC_RejectMalformed(parser);
+        }
+
+        VNC_WaitForDecodeJobs(vnc->decoder, r);
+
+        parser->row = 0;
+        parser->offset = 0;
+        parser->state = VNC_PARSE_RAW_ROWS;
+        return 1;
+    }
+
+    parser->state = VNC_PARSE_RECT;
+
+    return 1;
+}
+
+/*
+ * Parses a rectangle of any encoding but raw, decoding it once it has arrived
+ * in full.
+ */
+int VNC_ParseRect(VNC_Connection *vnc, Uint8 *data, size_t avail) {
+    VNC_Parser *parser = vnc->parser;
+    VNC_ReceiveBuffer *rb = &vnc->recv_buffer;
+
+    int res = VNC_MeasureRect(vnc, data, avail);
+    if (res <= 0) {
+        return res;
+    }
+
+    /*
+     * A rectangle that cannot be decoded fails the connection, as malformed
+     * unless its handler says it ran out of memory or lost the server.
+     */
+    size_t end = rb->start + parser->length;
+    parser->error = VNC_ERROR_MALFORMED_DATA;
+
+    if (VNC_HandleRectangle(vnc, &parser->header) < 0) {
+        return -1;
+    }
+
+    parser->error = VNC_ERROR_SERVER_DISCONNECT;
+    rb->start = end;
+
+    return VNC_NextRect(vnc);
+}
+
+/*
+ * Writes what pixels of a raw rectangle are buffered to the framebuffer.
+ */
+int VNC_ParseRawRows(VNC_Connection *vnc, size_t avail) {
+    VNC_Parser *parser = vnc->parser;
+    VNC_ReceiveBuffer *rb = &vnc->recv_buffer;
+
+    if (parser->row == parser->header.r.h) {
+        VNC_AddDamage(vnc, &parser->header.r);
+        return VNC_NextRect(vnc);
+    }
+
+    if (!avail) {
+        parser->need = 1;
+        return 0;
+    }
+
+    struct iovec iov[VNC_RECV_IOVECS];
+    int n = VNC_RawDestinations(vnc, iov, VNC_RECV_IOVECS);
+    size_t copied = 0;
+
+    if (SDL_MUSTLOCK(vnc->surface)) {
+        SDL_LockSurface(vnc->surface);
+    }
+
+    for (int i = 0; i < n && copied < avail; i++) {
+        size_t chunk = SDL_min(iov[i].iov_len, avail - copied);
+        SDL_memcpy(iov[i].iov_base, rb->data + rb->start + copied, chunk);
+        copied += chunk;
+    }
+
+    rb->start += copied;
+    VNC_RawWritten(vnc, copied);
+
+    if (SDL_MUSTLOCK(vnc->surface)) {
+        SDL_UnlockSurface(vnc->surface);
+    }
+
+    return 1;
+}
+
+/*
+ * Parses as much of what is in the receive buffer as possible, handling each
+ * message and rectangle once it has arrived in full. Never blocks: whatever is
+ * left over is kept in the buffer, and parsing picks up where it left off once
+ * more has arrived.
+ *
+ * Returns 0 once more data is needed, and -1 on error.
+ */
+int VNC_ParseMessages(VNC_Connection *vnc) {
+    VNC_Parser *parser = vnc->parser;
+    VNC_ReceiveBuffer *rb = &vnc->recv_buffer;
+    int res;
+
+    do {
+        Uint8 *data = rb->data + rb->start;
+        size_t avail = rb->end - rb->start;
+
+        switch (parser->state) {
+            case VNC_PARSE_MESSAGE_TYPE:
+                res = VNC_ParseMessageType(vnc, data, avail);
+                break;
+
+            case VNC_PARSE_MESSAGE:
+                res = VNC_ParseMessage(vnc, data, avail);
+                break;
+
+            case VNC_PARSE_UPDATE_HEADER:
+                res = VNC_ParseUpdateHeader(vnc, data, avail);
+                break;
+
+            case VNC_PARSE_RECT_HEADER:
+                res = VNC_ParseRectHeader(vnc, data, avail);
+                break;
+
+            case VNC_PARSE_RECT:
+                res = VNC_ParseRect(vnc, data, avail);
+                break;
+
+            default:
+                res = VNC_ParseRawRows(vnc, avail);
+                break;
+        }
+    } while (res > 0);
+
+    return res;
+}
+
+/*
+ * Receives pixels of the raw rectangle being parsed straight into their rows
+ * of the framebuffer, as many as can be without blocking.
+ */
+ssize_t VNC_ReceiveRawRows(VNC_Connection *vnc) {
+    struct iovec iov[VNC_RECV_IOVECS];
+    int n = VNC_RawDestinations(vnc, iov, VNC_RECV_IOVECS);
+
+    if (SDL_MUSTLOCK(vnc->surface)) {
+        SDL_LockSurface(vnc->surface);
+    }
+
+    ssize_t bytes_read = VNC_RecvVector(vnc, iov, n, MSG_DONTWAIT);
+
+    if (bytes_read > 0) {
+        VNC_RawWritten(vnc, bytes_read);
+    }
+
+    if (SDL_MUSTLOCK(vnc->surface)) {
+        SDL_UnlockSurface(vnc->surface);
+    }
+
+    return bytes_read;
+}
+
+/*
+ * Receives whatever the server has sent that can be without blocking, and
+ * parses it.
+ *
+ * Data is received into the receive buffer, which grows to hold the largest
+ * message or rectangle that arrives. The exception is raw pixel data, which
+ * once the buffer has been drained is received straight into the rows of the
+ * framebuffer it is for.
+ *
+ * Returns 0 once nothing more can be received without blocking, or once the
+ * connection's decode jobs are backlogged while a connection manager polls it,
+ * and -1 if the server disconnected or an error occurred.
+ */
+int VNC_ReceiveAvailable(VNC_Connection *vnc) {
+    VNC_Parser *parser = vnc->parser;
+    VNC_ReceiveBuffer *rb = &vnc->recv_buffer;
+
+    for (;;) {
+        ssize_t bytes_read;
+
+        /* the event loop resumes reading once the decode threads catch up */
+        if (vnc->manager && VNC_DecodeBacklogged(vnc->decoder)) {
+            return 0;
+        }
+
+        if (parser->state == VNC_PARSE_RAW_ROWS && rb->start == rb->end &&
+                VNC_RawBytesLeft(vnc) >= VNC_DIRECT_READ_THRESHOLD) {
+            bytes_read = VNC_ReceiveRawRows(vnc);
+
+        } else {
+            if (VNC_ReserveReceiveBuffer(rb, parser->need)) {
+                parser->error = VNC_ERROR_OOM;
+                return -1;
+            }
+
+            bytes_read = VNC_FillReceiveBuffer(vnc, MSG_DONTWAIT);
+        }
+
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        if (bytes_read == 0) {
+            return -1;
+        }
+
+        vnc->requests.last_message = VNC_Now();
+
+        if (VNC_ParseMessages(vnc)) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Receives data from the server into the connection's ring for as long as the
+ * connection lasts, blocking in recv while there is room and waiting for the
+ * polling thread to make room while there is none.
+ */
+int VNC_ReceiverThread(void *data) {
+    VNC_Connection *vnc = data;
+    VNC_ReceiveRing *ring = vnc->ring;
+    Uint32 written = SDL_AtomicGet(&ring->written);
+
+    while (!SDL_AtomicGet(&ring->stopping)) {
+        Uint32 used = written - (Uint32) SDL_AtomicGet(&ring->read);
+
+        if (used == VNC_RING_SIZE) {
+            SDL_AtomicCAS(&ring->writer_waiting, 0, 1);
+
+            if (VNC_RingUsed(ring) == VNC_RING_SIZE &&
+                    !SDL_AtomicGet(&ring->stopping)) {
+                int res = VNC_WaitForReadable(ring->space_ready, 0);
+
+                /* a broken eventfd would never block, and so never stop */
+                if (res < 0 ||
+                        (res > 0 && VNC_ClearEventFd(ring->space_ready))) {
+                    ring->error = errno;
+                    break;
+                }
+            }
+
+            SDL_AtomicSet(&ring->writer_waiting, 0);
+            continue;
+        }
+
+        /* the free space wraps around the end of the ring at most once */
+        size_t offset = written & (VNC_RING_SIZE - 1);
+        size_t space = VNC_RING_SIZE - used;
+
+        struct iovec iov[2];
+        iov[0].iov_base = ring->data + offset;
+        iov[0].iov_len = SDL_min(space, VNC_RING_SIZE - offset);
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = space - iov[0].iov_len;
+
+        struct msghdr msg;
+        SDL_zero(msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        Uint64 start = SDL_GetPerformanceCounter();
+        ssize_t bytes_read = recvmsg(vnc->socket, &msg, 0);
+
+        vnc->stats.recv_ticks += SDL_GetPerformanceCounter() - start;
+        vnc->stats.recv_calls++;
+
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes_read <= 0) {
+            ring->error = bytes_read < 0 ? errno : 0;
+            break;
+        }
+
+        written += bytes_read;
+        SDL_AtomicAdd(&ring->written, bytes_read);
+
+        if (SDL_AtomicGet(&ring->reader_waiting) &&
+                VNC_SignalEventFd(ring->data_ready)) {
+            ring->error = errno;
+            break;
+        }
+    }
+
+    SDL_AtomicSet(&ring->closed, 1);
+    VNC_SignalEventFd(ring->data_ready);
+
+    return 0;
+}
+
+void VNC_DestroyReceiveRing(VNC_ReceiveRing *ring) {
+    if (ring->data_ready >= 0) {
+        close(ring->data_ready);
+    }
+
+    if (ring->space_ready >= 0) {
+        close(ring->space_ready);
+    }
+
+    SDL_free(ring->data);
+    SDL_free(ring);
+}
+
+/*
+ * Gives a connection a receive ring, and starts its receiver thread.
+ */
+int VNC_StartReceiver(VNC_Connection *vnc) {
+    VNC_ReceiveRing *ring = SDL_calloc(1, sizeof (VNC_ReceiveRing));
+    if (!ring) {
+        return -1;
+    }
+
+    ring->data = SDL_malloc(VNC_RING_SIZE);
+    ring->data_ready = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ring->space_ready = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (!ring->data || ring->data_ready < 0 || ring->space_ready < 0) {
+        VNC_DestroyReceiveRing(ring);
+        return -1;
+    }
+
+    vnc->ring = ring;
+
+    ring->thread = SDL_CreateThread(VNC_ReceiverThread, "RFB Receiver", vnc);
+    if (!ring->thread) {
+        vnc->ring = NULL;
+        VNC_DestroyReceiveRing(ring);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Stops a connection's receiver thread, once the polling thread is done with
+ * the connection, and frees its receive ring.
+ */
+void VNC_StopReceiver(VNC_Connection *vnc) {
+    VNC_ReceiveRing *ring = vnc->ring;
+
+    /* wakes the receiver from recv, or from waiting for room */
+    SDL_AtomicSet(&ring->stopping, 1);
+    shutdown(vnc->socket, SHUT_RD);
+    VNC_SignalEventFd(ring->space_ready);
+
+    SDL_WaitThread(ring->thread, NULL);
+
+    vnc->ring = NULL;
+    VNC_DestroyReceiveRing(ring);
+}
+
+int VNC_UpdateLoop(void *data) {
+    VNC_Connection *vnc = data;
+
+    SDL_Event disconnect_event;
+    SDL_zero(disconnect_event);
+    disconnect_event.type = VNC_SHUTDOWN;
+    disconnect_event.user.data1 = vnc;
+
+    while (vnc->thread) {
+        if (VNC_WaitForMessage(vnc) || VNC_ReceiveAvailable(vnc)) {
+            disconnect_event.user.code = vnc->parser->error;
+            break;
+        }
+    }
+
+    VNC_StopReceiver(vnc);
+
+    SDL_PushEvent(&disconnect_event);
+
+    return 0;
+}
+
+SDL_Thread *VNC_CreateUpdateThread(VNC_Connection *vnc) {
+    return SDL_CreateThread(VNC_UpdateLoop, "RFB Listener", vnc);
+}
+
+int VNC_Handshake(VNC_Connection *vnc) {
+    VNC_RFBProtocolVersion server_version = VNC_ReceiveServerVersion(vnc);
+    VNC_RFBProtocolVersion client_version =
+        server_version == RFB_OTHER ? RFB_33 : server_version;
+
+    VNC_SendClientVersion(vnc, client_version);
+
+    VNC_NegotiateSecurity(vnc, client_version);
+
+    VNC_ClientInitialisation(vnc);
+    VNC_ServerInitialisation(vnc);
+
+    return 0;
+}
+
+int VNC_InitWithDecodeThreads(int threads) {
+    SDL_InitSubSystem(SDL_INIT_VIDEO);
+    VNC_SHUTDOWN = SDL_RegisterEvents(2);
+    VNC_FRAME_READY = VNC_SHUTDOWN + 1;
+
+    if (VNC_StartDecodePool(threads)) {
+        return VNC_ERROR_OOM;
+    }
+
+    return 0;
+}
+
+int VNC_Init(void) {
+    return VNC_InitWithDecodeThreads(VNC_THREAD_PER_CORE);
+}
+
+VNC_Result VNC_OpenConnection(VNC_Connection *vnc, char *host, Uint16 port,
+        unsigned fps) {
+
+    int res;
+
+    vnc->fps = fps;
+    vnc->surface = NULL;
+    vnc->thread = NULL;
+    vnc->manager = NULL;
+    vnc->ring = NULL;
+    vnc->outbox = NULL;
+    vnc->frames = NULL;
+    SDL_AtomicSet(&vnc->frame_ready, 0);
+    vnc->pixel_format = VNC_DEFAULT_PIXEL_FORMAT;
+    vnc->pending_pixel_format = SDL_PIXELFORMAT_UNKNOWN;
+    vnc->adaptive_color = SDL_TRUE;
+    vnc->color_level = VNC_COLOR_FULL;
+    vnc->pixel_lut = NULL;
+    vnc->supports_fence = SDL_FALSE;
+    vnc->supports_continuous_updates = SDL_FALSE;
+    vnc->continuous_updates = SDL_FALSE;
+    vnc->syncing_pixel_format = SDL_FALSE;
+
+    vnc->lock = SDL_CreateMutex();
+    if (!vnc->lock) {
+        return VNC_ERROR_OOM;
+    }
+
+    res = VNC_InitBuffer(&vnc->buffer);
+    if (res) {
+        return VNC_ERROR_OOM;
+    }
+
+    res = VNC_InitReceiveBuffer(&vnc->recv_buffer);
+    if (res) {
+        return VNC_ERROR_OOM;
+    }
+
+    vnc->parser = VNC_CreateParser();
+    if (!vnc->parser) {
+        return VNC_ERROR_OOM;
+    }
+
+    SDL_zero(vnc->stats);
+
+    SDL_zero(vnc->requests);
+    vnc->requests.max_window = VNC_MAX_UPDATE_REQUESTS;
+    vnc->requests.window = 1;
+    vnc->requests.settled = SDL_TRUE;
+
+    vnc->zrle_stream = VNC_CreateZlibStream();
+    if (!vnc->zrle_stream) {
+        return VNC_ERROR_OOM;
+    }
+
+    for (int i = 0; i < VNC_DECODE_CHAINS; i++) {
+        vnc->tight_streams[i] = VNC_CreateZlibStream();
+        if (!vnc->tight_streams[i]) {
+            return VNC_ERROR_OOM;
+        }
+    }
+
+    vnc->decoder = VNC_CreateDecodeScheduler();
+    if (!vnc->decoder) {
+        return VNC_ERROR_OOM;
+    }
+
+    vnc->damage = VNC_CreateDamage();
+    if (!vnc->damage) {
+        return VNC_ERROR_OOM;
+    }
+
+    vnc->socket = VNC_CreateSocket();
+    if (vnc->socket <= 0) {
+        return VNC_ERROR_COULD_NOT_CREATE_SOCKET;
+    }
+
+    res = VNC_Connect(vnc, host, port);
+    if (res) {
+        return VNC_ERROR_COULD_NOT_CONNECT;
+    }
+
+    VNC_Handshake(vnc);
+
+    res = VNC_SetPixelFormat(vnc, VNC_DEFAULT_PIXEL_FORMAT);
+    if (res) {
+        return res;
+    }
+
+    VNC_RectangleEncodingMethod encodings[] = {
+        TIGHT,
+        ZRLE,
+        TRLE,
+        HEXTILE,
+        CORRE,
+        RRE,
+        COPY_RECT,
+        RAW,
+        PSEUDO_DESKTOP_SIZE,
+        PSEUDO_QUALITY_LEVEL_0 + VNC_TIGHT_JPEG_QUALITY,
+        PSEUDO_CONTINUOUS_UPDATES,
+        PSEUDO_FENCE
+        // PSEUDO_CURSOR
+    };
+    VNC_SetEncodings(vnc, encodings,
+            (sizeof (encodings) / sizeof (VNC_RectangleEncodingMethod)));
+
+    vnc->surface = VNC_CreateSurfaceForConnection(vnc);
+    if (!vnc->surface || VNC_DamageSurface(vnc)) {
+        return VNC_ERROR_OOM;
+    }
+
+    return 0;
+}
+
+VNC_Result VNC_StartConnection(VNC_Connection *vnc) {
+    if (vnc->thread || vnc->manager) {
+        return VNC_ERROR_ALREADY_STARTED;
+    }
+
+    /*
+     * Sent only now so that the first update is in the pixel format set after
+     * VNC_OpenConnection, if any.
+     */
+    if (VNC_SendUpdateRequest(vnc, SDL_FALSE) < 0) {
+        return VNC_ERROR_SERVER_DISCONNECT;
+    }
+
+    /*
+     * Data is received on a thread of its own, so that the socket keeps being
+     * read while the polling thread parses and decodes what has arrived.
+     */
+    if (VNC_StartReceiver(vnc)) {
+        return VNC_ERROR_OOM;
+    }
+
+    vnc->thread = VNC_CreateUpdateThread(vnc);
+    if (!vnc->thread) {
+        VNC_StopReceiver(vnc);
+        return VNC_ERROR_OOM;
+    }
+
+    return 0;
+}
+
+VNC_Result VNC_InitConnection(VNC_Connection *vnc, char *host, Uint16 port,
+        unsigned fps) {
+
+    VNC_Result res = VNC_OpenConnection(vnc, host, port, fps);
+    if (res) {
+        return res;
+    }
+
+    return VNC_StartConnection(vnc);
 }
 
-int VNC_SetEncodings(VNC_Connection *vnc,
-        VNC_RectangleEncodingMethod *encodings, uint n) {
+void VNC_WaitOnConnection(VNC_Connection *vnc) {
+    SDL_WaitThread(vnc->thread, NULL);
+}
 
-    /*
-     * Message size is:
-     * - 2 bytes for message type;
-     * - 1 byte padding;
-     * - 2 bytes for number of encodings;
-     * - 4-byte-wide encoding ID per encoding.
-     */
-    size_t msg_size = 4 + n * 4;
+/*
+ * Maximum number of epoll events an event loop handles per wakeup.
+ */
+#define VNC_EPOLL_EVENTS 64
+
+/*
+ * An event loop of a connection manager, dispatching the data that arrives on
+ * its share of the manager's connections to their parsers. Its lock is held
+ * whenever a connection of the loop is being serviced, so that a connection
+ * can only be removed in between.
+ */
+typedef struct {
+    VNC_ConnectionManager *manager;
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    int epoll;
+
+    /* wakes the loop up to recompute its timer, or to stop */
+    int wake;
+
+    /* fires when the first update request of any connection falls due */
+    int timer;
+
+    VNC_Connection **connections;
+    int count;
+    int capacity;
+} VNC_EventLoop;
+
+struct VNC_ConnectionManager {
+    SDL_atomic_t running;
+    int loop_count;
+    VNC_EventLoop *loops;
+};
+
+/*
+ * Tags for the epoll events of an event loop's own file descriptors, told
+ * apart from connections by address.
+ */
+static char VNC_LOOP_WAKE;
+static char VNC_LOOP_TIMER;
+
+int VNC_FindLoopConnection(VNC_EventLoop *loop, VNC_Connection *vnc) {
+    for (int i = 0; i < loop->count; i++) {
+        if (loop->connections[i] == vnc) {
+            return i;
+        }
+    }
 
-    VNC_AssureBufferSize(vnc->buffer, msg_size);
+    return -1;
+}
 
-    Uint8 *msg = (Uint8 *) vnc->buffer.data;
-    *msg++ = 2; // ID of SetEncoding message
-    msg++;
+void VNC_RemoveLoopConnection(VNC_EventLoop *loop, int i) {
+    VNC_Connection *vnc = loop->connections[i];
 
-    Uint16 *encoding_count = (Uint16 *) msg;
-    *encoding_count++ = SDL_SwapBE16(n);
+    epoll_ctl(loop->epoll, EPOLL_CTL_DEL, vnc->socket, NULL);
+    loop->connections[i] = loop->connections[--loop->count];
 
-    Sint32 *encoding_ids = (Sint32 *) encoding_count;
-    for (uint i = 0; i < n; i++) {
-        *encoding_ids++ = SDL_SwapBE32(encodings[i]);
-    }
+    /* what is left in the outbox is sent with the next message, blocking */
+    SDL_LockMutex(vnc->outbox->lock);
+    vnc->outbox->wake = -1;
+    SDL_UnlockMutex(vnc->outbox->lock);
 
-    return VNC_ToServer(vnc->socket, vnc->buffer.data, msg_size);
+    SDL_AtomicSet(&vnc->decoder->wake, -1);
 }
 
-int VNC_RawFromServer(VNC_Connection *vnc, VNC_RectangleHeader *header) {
-    VNC_ServerToScratchBuffer(vnc, header->r.w, header->r.h);
-    return SDL_BlitSurface(vnc->scratch_buffer, NULL, vnc->surface, &header->r);
+void VNC_WakeEventLoop(VNC_EventLoop *loop) {
+    VNC_SignalEventFd(loop->wake);
 }
 
-int VNC_CopyRectFromServer(VNC_Connection *vnc, VNC_RectangleHeader *header) {
-    VNC_ServerToBuffer(vnc, 4);
-    Uint16 *src_info = (Uint16 *) vnc->buffer.data;
+/*
+ * Drops a connection that failed from its event loop, and tells the
+ * application with a VNC_SHUTDOWN event.
+ */
+void VNC_CloseLoopConnection(VNC_EventLoop *loop, int i) {
+    VNC_Connection *vnc = loop->connections[i];
 
-    SDL_Rect src;
-    src.x = SDL_SwapBE16(*src_info++);
-    src.y = SDL_SwapBE16(*src_info++);
-    src.w = header->r.w;
-    src.h = header->r.h;
+    SDL_Event disconnect_event;
+    SDL_zero(disconnect_event);
+    disconnect_event.type = VNC_SHUTDOWN;
+    disconnect_event.user.code = vnc->parser->error;
+    disconnect_event.user.data1 = vnc;
 
-    return SDL_BlitSurface(vnc->surface, &src, vnc->surface, &header->r);
+    VNC_RemoveLoopConnection(loop, i);
+    SDL_PushEvent(&disconnect_event);
 }
 
-int VNC_DesktopSizeFromServer(VNC_Connection *vnc, VNC_RectangleHeader *header) {
-    vnc->server_details.w = header->r.w;
-    vnc->server_details.h = header->r.h;
+/*
+ * Sends the update requests of an event loop's connections that have fallen
+ * due, and arms the loop's timer for when the next one does.
+ */
+void VNC_ArmLoopTimer(VNC_EventLoop *loop) {
+    Uint64 first = 0;
 
-    if (vnc->surface) {
-        SDL_FreeSurface(vnc->surface);
-        vnc->surface = VNC_CreateSurfaceForServer(&vnc->server_details);
-    }
+    for (int i = 0; i < loop->count; i++) {
+        Uint64 due;
 
-    if (vnc->window) {
-        SDL_SetWindowSize(vnc->window, header->r.w, header->r.h);
+        if (VNC_SendDueRequests(loop->connections[i], &due)) {
+            VNC_CloseLoopConnection(loop, i--);
+            continue;
+        }
+
+        if (due && (!first || due < first)) {
+            first = due;
+        }
     }
 
-    return 0;
+    /* an all-zero value disarms the timer */
+    struct itimerspec when;
+    SDL_zero(when);
+    when.it_value.tv_sec = first / VNC_NS_PER_SECOND;
+    when.it_value.tv_nsec = first % VNC_NS_PER_SECOND;
+
+    timerfd_settime(loop->timer, TFD_TIMER_ABSTIME, &when, NULL);
 }
 
-int VNC_HandleRectangle(VNC_Connection *vnc, VNC_RectangleHeader *header) {
-    VNC_ServerToBuffer(vnc, 12);
+/*
+ * Has an event loop watch each of its connections' sockets for data from the
+ * server unless the connection's decode jobs are backlogged, and for room to
+ * send more if its outbox holds any.
+ */
+void VNC_WatchLoopConnections(VNC_EventLoop *loop) {
+    for (int i = 0; i < loop->count; i++) {
+        VNC_Connection *vnc = loop->connections[i];
+        VNC_Outbox *outbox = vnc->outbox;
 
-    Uint16 *rect_info = (Uint16 *) vnc->buffer.data;
-    header->r.x = SDL_SwapBE16(*rect_info++);
-    header->r.y = SDL_SwapBE16(*rect_info++);
-    header->r.w = SDL_SwapBE16(*rect_info++);
-    header->r.h = SDL_SwapBE16(*rect_info++);
+        Uint32 events = VNC_DecodeBacklogged(vnc->decoder) ? 0 : EPOLLIN;
 
-    header->e = SDL_SwapBE32(*((Sint32 *) (rect_info)));
+        SDL_LockMutex(outbox->lock);
 
-    switch (header->e) {
-        case RAW:
-            return VNC_RawFromServer(vnc, header);
+        if (outbox->length) {
+            events |= EPOLLOUT;
+        }
 
-        case COPY_RECT:
-            return VNC_CopyRectFromServer(vnc, header);
+        if (events != outbox->events) {
+            struct epoll_event event;
+            SDL_zero(event);
+            event.events = events;
+            event.data.ptr = vnc;
 
-        case PSEUDO_DESKTOP_SIZE:
-            return VNC_DesktopSizeFromServer(vnc, header);
+            epoll_ctl(loop->epoll, EPOLL_CTL_MOD, vnc->socket, &event);
+            outbox->events = events;
+        }
 
-        default:
-            warn("unknown encoding method %i\n", header->e);
-            exit(0);
-            return 0;
+        SDL_UnlockMutex(outbox->lock);
     }
 }
 
-int VNC_FrameBufferUpdate(VNC_Connection *vnc) {
-    char buf[3];
-    VNC_FromServer(vnc->socket, buf, 3);
-    Uint16 rect_count = SDL_SwapBE16(*((Uint16 *) (buf + 1)));
+/*
+ * Sends what a connection's outbox holds as far as the socket takes it.
+ */
+int VNC_FlushLoopConnection(VNC_Connection *vnc) {
+    SDL_LockMutex(vnc->outbox->lock);
+    int res = VNC_FlushOutbox(vnc->outbox, vnc->socket, MSG_DONTWAIT);
+    SDL_UnlockMutex(vnc->outbox->lock);
 
-    debug("receiving framebuffer update of %u rectangles\n", rect_count);
+    return res;
+}
 
-    for (uint i = 0; i < rect_count; i++) {
-        VNC_RectangleHeader header;
-        VNC_HandleRectangle(vnc, &header);
+/*
+ * Runs one iteration of an event loop: waits up to timeout milliseconds, or
+ * indefinitely if negative, for data to arrive on any of its connections, for
+ * room to send what their outboxes hold, or for an update request to fall due,
+ * then parses whatever arrived.
+ *
+ * Data from a connection whose decode jobs are backlogged is left unread until
+ * they have caught up, which wakes the loop.
+ */
+int VNC_RunEventLoop(VNC_EventLoop *loop, int timeout) {
+    struct epoll_event events[VNC_EPOLL_EVENTS];
+
+    SDL_LockMutex(loop->lock);
+    VNC_ArmLoopTimer(loop);
+    VNC_WatchLoopConnections(loop);
+    SDL_UnlockMutex(loop->lock);
+
+    int n = epoll_wait(loop->epoll, events, VNC_EPOLL_EVENTS, timeout);
+
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
     }
 
-    return 0;
-}
+    SDL_LockMutex(loop->lock);
 
-int VNC_FramebufferUpdateRequest(int socket, SDL_bool incremental, Uint16 x,
-        Uint16 y, Uint16 w, Uint16 h) {
+    for (int i = 0; i < n; i++) {
+        void *tag = events[i].data.ptr;
 
-    debug("sending framebuffer update request\n");
+        if (tag == &VNC_LOOP_WAKE) {
+            VNC_ClearEventFd(loop->wake);
+            continue;
+        }
 
-    char msg[10];
+        if (tag == &VNC_LOOP_TIMER) {
+            VNC_ClearEventFd(loop->timer);
+            continue;
+        }
 
-    Uint8 *msg_as_8b = (Uint8 *) msg;
-    *msg_as_8b++ = 3;
-    *msg_as_8b++ = incremental;
+        /* the connection may have been removed since the wait */
+        int index = VNC_FindLoopConnection(loop, tag);
 
-    Uint16 *msg_as_16b = (Uint16 *) msg_as_8b;
-    *msg_as_16b++ = x;
-    *msg_as_16b++ = y;
-    *msg_as_16b++ = w;
-    *msg_as_16b++ = h;
+        if (index < 0) {
+            continue;
+        }
 
-    return VNC_ToServer(socket, msg, 10);
-}
+        if ((events[i].events & EPOLLOUT && VNC_FlushLoopConnection(tag)) ||
+                (events[i].events & ~EPOLLOUT && VNC_ReceiveAvailable(tag))) {
+            VNC_CloseLoopConnection(loop, index);
+        }
+    }
 
-int VNC_ResizeColorMap(VNC_ColorMap *color_map, size_t n) {
-    color_map->data = realloc(color_map->data, n * sizeof (VNC_ColorMapEntry));
+    SDL_UnlockMutex(loop->lock);
 
-    return !color_map->data;
+    return 0;
 }
 
-int VNC_AssureColourMapSize(VNC_ColorMap *color_map, size_t n) {
-    if (color_map->size < n) {
-        return VNC_ResizeColorMap(color_map, n);
+int VNC_EventLoopThread(void *data) {
+    VNC_EventLoop *loop = data;
+
+    while (SDL_AtomicGet(&loop->manager->running)) {
+        VNC_RunEventLoop(loop, -1);
     }
 
     return 0;
 }
 
-int VNC_SetColorMapEntries(VNC_Connection *vnc) {
-    VNC_ServerToBuffer(vnc, 5);
-
-    char *blank = (char *) (vnc->buffer.data);
-    blank++;
+int VNC_AddLoopFd(VNC_EventLoop *loop, int fd, void *tag) {
+    struct epoll_event event;
+    SDL_zero(event);
+    event.events = EPOLLIN;
+    event.data.ptr = tag;
 
-    Uint16 *buf = (Uint16 *) blank;
-    Uint16 first_color_index = *buf++;
-    Uint16 number_of_colors = *buf++;
-    Uint16 color_index_end = first_color_index + number_of_colors;
-
-    debug("updating colors %u-%u in color map\n", first_color_index,
-            color_index_end - 1);
+    return epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &event);
+}
 
-    VNC_AssureColourMapSize(&vnc->color_map, color_index_end);
+int VNC_InitEventLoop(VNC_EventLoop *loop) {
+    loop->lock = SDL_CreateMutex();
+    loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 
-    for (uint i = first_color_index; i < color_index_end; i++) {
-        VNC_ServerToBuffer(vnc, 6);
+    if (!loop->lock || loop->epoll < 0 || loop->wake < 0 || loop->timer < 0) {
+        return -1;
+    }
 
-        Uint16 *colors = (Uint16 *) vnc->buffer.data;
-        vnc->color_map.data[i].r = *colors++;
-        vnc->color_map.data[i].g = *colors++;
-        vnc->color_map.data[i].b = *colors++;
+    if (VNC_AddLoopFd(loop, loop->wake, &VNC_LOOP_WAKE) ||
+            VNC_AddLoopFd(loop, loop->timer, &VNC_LOOP_TIMER)) {
+        return -1;
     }
 
     return 0;
 }
 
-int VNC_UpdateLoop(void *data) {
-    VNC_Connection *vnc = data;
+void VNC_DestroyEventLoop(VNC_EventLoop *loop) {
+    if (loop->thread) {
+        VNC_WakeEventLoop(loop);
+        SDL_WaitThread(loop->thread, NULL);
+    }
 
-    SDL_Event disconnect_event;
-    disconnect_event.type = VNC_SHUTDOWN;
-    disconnect_event.user.code = 0;
+    /* connections still in the loop no longer refer to its eventfd */
+    while (loop->count) {
+        loop->connections[0]->manager = NULL;
+        VNC_RemoveLoopConnection(loop, 0);
+    }
 
-    while (vnc->thread) {
-        VNC_ServerMessageType msg;
-        int res = VNC_FromServer(vnc->socket, &msg, 1);
+    if (loop->lock) {
+        SDL_DestroyMutex(loop->lock);
+    }
 
-        if (res <= 0) {
-            disconnect_event.user.code = VNC_ERROR_SERVER_DISCONNECT;
-            break;
-        }
+    if (loop->epoll >= 0) {
+        close(loop->epoll);
+    }
 
-        switch (msg) {
-            case FRAME_BUFFER_UPDATE:
-                VNC_FrameBufferUpdate(vnc);
-                break;
+    if (loop->wake >= 0) {
+        close(loop->wake);
+    }
 
-            case SET_COLOUR_MAP_ENTRIES:
-                VNC_SetColorMapEntries(vnc);
-                break;
+    if (loop->timer >= 0) {
+        close(loop->timer);
+    }
 
-            //case BELL:
-            //    //server_bell(vnc);
-            //    break;
+    SDL_free(loop->connections);
+}
 
-            //case SERVER_CUT_TEXT:
-            //    //server_cut_text(vnc);
-            //    break;
+void VNC_DestroyConnectionManager(VNC_ConnectionManager *manager) {
+    SDL_AtomicSet(&manager->running, 0);
 
-            default:
-                disconnect_event.user.code = VNC_ERROR_UNIMPLEMENTED;
-                goto out_of_loop;
-        }
+    for (int i = 0; i < manager->loop_count; i++) {
+        VNC_DestroyEventLoop(&manager->loops[i]);
+    }
 
-        VNC_FramebufferUpdateRequest(vnc->socket, SDL_TRUE, 0, 0,
-                vnc->server_details.w, vnc->server_details.h);
+    SDL_free(manager->loops);
+    SDL_free(manager);
+}
 
-        SDL_Delay(1000 / vnc->fps);
+VNC_ConnectionManager *VNC_CreateConnectionManager(int threads) {
+    if (threads < 0) {
+        threads = SDL_GetCPUCount();
     }
 
-out_of_loop:
-
-    SDL_PushEvent(&disconnect_event);
+    VNC_ConnectionManager *manager = SDL_calloc(1,
+            sizeof (VNC_ConnectionManager));
+    if (!manager) {
+        return NULL;
+    }
 
-    return 0;
-}
+    SDL_AtomicSet(&manager->running, 1);
+    manager->loop_count = SDL_max(threads, 1);
+    manager->loops = SDL_calloc(manager->loop_count, sizeof (VNC_EventLoop));
 
-SDL_Thread *VNC_CreateUpdateThread(VNC_Connection *vnc) {
-    return SDL_CreateThread(VNC_UpdateLoop, "RFB Listener", vnc);
-}
+    if (!manager->loops) {
+        SDL_free(manager);
+        return NULL;
+    }
 
-int VNC_Handshake(VNC_Connection *vnc) {
-    VNC_RFBProtocolVersion server_version = VNC_ReceiveServerVersion(vnc);
-    VNC_RFBProtocolVersion client_version =
-        server_version == RFB_OTHER ? RFB_33 : server_version;
+    for (int i = 0; i < manager->loop_count; i++) {
+        VNC_EventLoop *loop = &manager->loops[i];
+        loop->manager = manager;
+        loop->epoll = -1;
+        loop->wake = -1;
+        loop->timer = -1;
+    }
 
-    VNC_SendClientVersion(vnc, client_version);
+    for (int i = 0; i < manager->loop_count; i++) {
+        if (VNC_InitEventLoop(&manager->loops[i])) {
+            VNC_DestroyConnectionManager(manager);
+            return NULL;
+        }
+    }
 
-    VNC_NegotiateSecurity(vnc, client_version);
+    for (int i = 0; i < threads; i++) {
+        VNC_EventLoop *loop = &manager->loops[i];
+        loop->thread = SDL_CreateThread(VNC_EventLoopThread, "RFB Event Loop",
+                loop);
 
-    VNC_ClientInitialisation(vnc);
-    VNC_ServerInitialisation(vnc);
+        if (!loop->thread) {
+            VNC_DestroyConnectionManager(manager);
+            return NULL;
+        }
+    }
 
-    return 0;
+    return manager;
 }
 
-int VNC_SendInitialFramebufferUpdateRequest(VNC_Connection *vnc) {
-    return VNC_FramebufferUpdateRequest(vnc->socket, SDL_FALSE, 0, 0,
-            vnc->server_details.w, vnc->server_details.h);
-}
+VNC_Result VNC_AddConnection(VNC_ConnectionManager *manager,
+        VNC_Connection *vnc) {
 
-int VNC_Init(void) {
-    SDL_InitSubSystem(SDL_INIT_VIDEO);
-    VNC_SHUTDOWN = SDL_RegisterEvents(1);
-    return 0;
-}
+    if (vnc->thread || vnc->manager) {
+        return VNC_ERROR_ALREADY_STARTED;
+    }
 
-VNC_Result VNC_InitConnection(VNC_Connection *vnc, char *host, Uint16 port,
-        unsigned fps) {
+    if (!vnc->outbox) {
+        vnc->outbox = VNC_CreateOutbox();
 
-    int res;
+        if (!vnc->outbox) {
+            return VNC_ERROR_OOM;
+        }
+    }
 
-    vnc->fps = fps;
-    vnc->scratch_buffer = NULL;
+    /* as in VNC_StartConnection */
+    if (VNC_SendUpdateRequest(vnc, SDL_FALSE) < 0) {
+        return VNC_ERROR_SERVER_DISCONNECT;
+    }
 
-    res = VNC_InitBuffer(&vnc->buffer);
-    if (res) {
-        return VNC_ERROR_OOM;
+    /* sessions are spread over the loops, rather than each given a thread */
+    VNC_EventLoop *loop = &manager->loops[0];
+
+    for (int i = 1; i < manager->loop_count; i++) {
+        if (manager->loops[i].count < loop->count) {
+            loop = &manager->loops[i];
+        }
     }
 
-    vnc->socket = VNC_CreateSocket();
-    if (vnc->socket <= 0) {
-        return VNC_ERROR_COULD_NOT_CREATE_SOCKET;
+    SDL_LockMutex(loop->lock);
+
+    if (loop->count == loop->capacity) {
+        int capacity = SDL_max(2 * loop->capacity, 8);
+        VNC_Connection **connections = SDL_realloc(loop->connections,
+                capacity * sizeof (VNC_Connection *));
+
+        if (!connections) {
+            SDL_UnlockMutex(loop->lock);
+            return VNC_ERROR_OOM;
+        }
+
+        loop->connections = connections;
+        loop->capacity = capacity;
     }
 
-    res = VNC_Connect(vnc, host, port);
-    if (res) {
-        return VNC_ERROR_COULD_NOT_CONNECT;
+    if (VNC_AddLoopFd(loop, vnc->socket, vnc)) {
+        SDL_UnlockMutex(loop->lock);
+        return VNC_ERROR_OOM;
     }
 
-    VNC_Handshake(vnc);
+    loop->connections[loop->count++] = vnc;
+    vnc->manager = manager;
 
-    VNC_RectangleEncodingMethod encodings[] = {
-        COPY_RECT,
-        RAW,
-        PSEUDO_DESKTOP_SIZE,
-        PSEUDO_CONTINUOUS_UPDATES
-        // PSEUDO_CURSOR
-    };
-    VNC_SetEncodings(vnc, encodings,
-            (sizeof (encodings) / sizeof (VNC_RectangleEncodingMethod)));
+    SDL_LockMutex(vnc->outbox->lock);
+    vnc->outbox->wake = loop->wake;
+    vnc->outbox->events = EPOLLIN;
+    SDL_UnlockMutex(vnc->outbox->lock);
 
-    VNC_SendInitialFramebufferUpdateRequest(vnc);
+    SDL_AtomicSet(&vnc->decoder->wake, loop->wake);
 
-    vnc->surface = VNC_CreateSurfaceForServer(&vnc->server_details);
-    vnc->thread = VNC_CreateUpdateThread(vnc);
+    SDL_UnlockMutex(loop->lock);
+
+    /* its first update request may fall due before the loop's timer */
+    VNC_WakeEventLoop(loop);
 
     return 0;
 }
 
-void VNC_WaitOnConnection(VNC_Connection *vnc) {
-    SDL_WaitThread(vnc->thread, NULL);
+void VNC_RemoveConnection(VNC_ConnectionManager *manager,
+        VNC_Connection *vnc) {
+
+    for (int i = 0; i < manager->loop_count; i++) {
+        VNC_EventLoop *loop = &manager->loops[i];
+
+        /* waits for the loop to finish servicing the connection */
+        SDL_LockMutex(loop->lock);
+
+        int index = VNC_FindLoopConnection(loop, vnc);
+        if (index >= 0) {
+            VNC_RemoveLoopConnection(loop, index);
+        }
+
+        SDL_UnlockMutex(loop->lock);
+    }
+
+    vnc->manager = NULL;
+}
+
+int VNC_PollConnections(VNC_ConnectionManager *manager, int timeout) {
+    VNC_EventLoop *loop = &manager->loops[0];
+
+    if (loop->thread) {
+        return 0;
+    }
+
+    return VNC_RunEventLoop(loop, timeout);
 }
 
 Uint32 VNC_TranslateKey(SDL_KeyCode key, SDL_bool shift) {
@@ -980,7 +6945,7 @@ int VNC_SendPointerEvent(VNC_Connection *vnc, Uint32 buttons,
     *pos++ = SDL_SwapBE16(x);
     *pos++ = SDL_SwapBE16(y);
 
-    return VNC_ToServer(vnc->socket, buf, 6);
+    return VNC_SendToServer(vnc, buf, 6);
 }
 
 int VNC_SendKeyEvent(VNC_Connection *vnc, SDL_bool pressed, SDL_Keysym sym) {
@@ -997,7 +6962,7 @@ int VNC_SendKeyEvent(VNC_Connection *vnc, SDL_bool pressed, SDL_Keysym sym) {
     Uint32 *key_p = (Uint32 *) msg;
     *key_p = SDL_SwapBE32(VNC_TranslateKey(key, shift));
 
-    return VNC_ToServer(vnc->socket, buf, 8);
+    return VNC_SendToServer(vnc, buf, 8);
 }
 
 SDL_Window *VNC_CreateWindowForConnection(VNC_Connection *vnc, char *title,
@@ -1011,4 +6976,161 @@ SDL_Window *VNC_CreateWindowForConnection(VNC_Connection *vnc, char *title,
     return vnc->window;
 }
 
+/*
+ * Number of damaged rectangles uploaded to a streaming texture per update;
+ * damage is merged into fewer, larger rectangles beyond this.
+ */
+#define VNC_TEXTURE_RECTS 64
+
+void VNC_InitStreamingTexture(VNC_StreamingTexture *texture,
+        SDL_Renderer *renderer) {
+
+    texture->renderer = renderer;
+    texture->texture = NULL;
+}
+
+/*
+ * Checks that a texture can have the given surface uploaded to it as-is.
+ */
+SDL_bool VNC_TextureMatchesSurface(SDL_Texture *texture, SDL_Surface *surface) {
+    Uint32 format;
+    int w;
+    int h;
+
+    if (SDL_QueryTexture(texture, &format, NULL, &w, &h)) {
+        return SDL_FALSE;
+    }
+
+    return format == surface->format->format &&
+        w == surface->w && h == surface->h;
+}
+
+int VNC_UpdateStreamingTexture(VNC_StreamingTexture *texture,
+        VNC_Connection *vnc) {
+
+    SDL_Surface *frame = VNC_AcquireFrame(vnc);
+    SDL_Rect rects[VNC_TEXTURE_RECTS];
+    int n = VNC_TakeDamage(vnc, rects, VNC_TEXTURE_RECTS);
+
+    if (texture->texture &&
+            !VNC_TextureMatchesSurface(texture->texture, frame)) {
+        VNC_DestroyStreamingTexture(texture);
+    }
+
+    if (!texture->texture) {
+        texture->texture = SDL_CreateTexture(texture->renderer,
+                frame->format->format, SDL_TEXTUREACCESS_STREAMING,
+                frame->w, frame->h);
+
+        if (!texture->texture) {
+            return VNC_ERROR_RENDERER;
+        }
+
+        /*
+         * Textures with an alpha channel are created blending, but the server
+         * leaves the alpha bits unset at full color; frames are opaque.
+         */
+        if (SDL_SetTextureBlendMode(texture->texture, SDL_BLENDMODE_NONE)) {
+            VNC_DestroyStreamingTexture(texture);
+            return VNC_ERROR_RENDERER;
+        }
+
+        rects[0] = (SDL_Rect) { 0, 0, frame->w, frame->h };
+        n = 1;
+    }
+
+    Uint8 *pixels = frame->pixels;
+    int bpp = frame->format->BytesPerPixel;
+
+    for (int i = 0; i < n; i++) {
+        SDL_Rect *r = &rects[i];
+        Uint8 *src = pixels + r->y * frame->pitch + r->x * bpp;
+
+        if (SDL_UpdateTexture(texture->texture, r, src, frame->pitch)) {
+            VNC_DestroyStreamingTexture(texture);
+            return VNC_ERROR_RENDERER;
+        }
+    }
+
+    return 0;
+}
+
+void VNC_DestroyStreamingTexture(VNC_StreamingTexture *texture) {
+    if (texture->texture) {
+        SDL_DestroyTexture(texture->texture);
+        texture->texture = NULL;
+    }
+}
+
+void VNC_InitWindowSurface(VNC_WindowSurface *surface, SDL_Window *window) {
+    surface->window = window;
+    surface->surface = NULL;
+}
+
+int VNC_PresentWindowSurface(VNC_WindowSurface *surface, VNC_Connection *vnc) {
+    SDL_Surface *frame = VNC_AcquireFrame(vnc);
+    SDL_Rect rects[VNC_TEXTURE_RECTS];
+    int n = VNC_TakeDamage(vnc, rects, VNC_TEXTURE_RECTS);
+
+    /*
+     * SDL replaces the window surface when the window is resized, leaving the
+     * new one's contents undefined.
+     */
+    SDL_Surface *window_surface = SDL_GetWindowSurface(surface->window);
+    if (!window_surface) {
+        surface->surface = NULL;
+        return VNC_ERROR_RENDERER;
+    }
+
+    SDL_bool redraw = window_surface != surface->surface;
+    surface->surface = window_surface;
+
+    if (redraw) {
+        SDL_FillRect(window_surface, NULL, 0);
+        rects[0] = (SDL_Rect) { 0, 0, frame->w, frame->h };
+        n = 1;
+    }
+
+    /*
+     * Copy pixels as they are; when both surfaces have the same format, this
+     * is a plain row copy. The blit clips each rectangle to both surfaces, and
+     * only what was copied is presented.
+     */
+    SDL_SetSurfaceBlendMode(frame, SDL_BLENDMODE_NONE);
+
+    int drawn = 0;
+
+    for (int i = 0; i < n; i++) {
+        SDL_Rect dst = rects[i];
+
+        if (SDL_BlitSurface(frame, &rects[i], window_surface, &dst)) {
+            surface->surface = NULL;
+            return VNC_ERROR_RENDERER;
+        }
+
+        if (!SDL_RectEmpty(&dst)) {
+            rects[drawn++] = dst;
+        }
+    }
+
+    int res = 0;
+
+    if (redraw) {
+        res = SDL_UpdateWindowSurface(surface->window);
+    } else if (drawn) {
+        res = SDL_UpdateWindowSurfaceRects(surface->window, rects, drawn);
+    }
+
+    if (res) {
+        surface->surface = NULL;
+        return VNC_ERROR_RENDERER;
+    }
+
+    return 0;
+}
+
+void VNC_InvalidateWindowSurface(VNC_WindowSurface *surface) {
+    surface->surface = NULL;
+}
+
 /* vim: se ft=c tw=80 ts=4 sw=4 et : */
@@ -17,6 +17,213 @@ typedef struct {
     void *data;  /**< Pointer to data buffer. */
 } VNC_ConnectionBuffer;
 
+/**
+ * Structure used for buffering data received from the VNC server.
+ *
+ * Data is received into this buffer in large chunks, and messages are parsed
+ * from it once they have arrived in full, so that it grows to hold the largest
+ * message or rectangle received. Raw pixel data bypasses it and is received
+ * straight into the framebuffer.
+ */
+typedef struct {
+    size_t size;  /**< Capacity of buffer in bytes. */
+    size_t start; /**< Offset of the first byte not yet consumed. */
+    size_t end;   /**< Offset one past the last byte received. */
+    Uint8 *data;  /**< Pointer to data buffer. */
+} VNC_ReceiveBuffer;
+
+/**
+ * Statistics gathered over the lifetime of a VNC connection.
+ */
+typedef struct {
+    Uint64 recv_calls;     /**< Number of `recv` syscalls made. */
+    Uint64 bytes_received; /**< Number of bytes received from the server. */
+
+    /**
+     * Time spent in `recv` syscalls, in units of
+     * SDL_GetPerformanceFrequency.
+     */
+    Uint64 recv_ticks;
+
+    /**
+     * Estimated throughput of the connection in bytes per second, or 0 if no
+     * framebuffer update has been large enough to measure it yet.
+     */
+    double throughput;
+
+    /**
+     * Estimated round-trip time to the server in seconds, or 0 if no update
+     * request has been answered yet.
+     */
+    double rtt;
+
+    /** Number of framebuffer updates received. */
+    Uint64 updates;
+
+    /**
+     * Rate at which framebuffer updates were received over the last second or
+     * so, or 0 if not measured yet.
+     */
+    double update_rate;
+
+    /**
+     * Number of update request deadlines skipped because the polling thread
+     * fell more than a polling period behind.
+     */
+    Uint64 skipped_deadlines;
+
+    /**
+     * When the current measurement of `update_rate` started, on the clock of
+     * VNC_Now.
+     */
+    Uint64 rate_start;
+
+    /** Value of `updates` when the current measurement started. */
+    Uint64 rate_updates;
+} VNC_ConnectionStats;
+
+/**
+ * Maximum number of framebuffer update requests kept in flight while polling
+ * the server for updates.
+ */
+#define VNC_MAX_UPDATE_REQUESTS 16
+
+/**
+ * Number of recent round-trip times the connection's round-trip time is
+ * estimated from.
+ */
+#define VNC_RTT_SAMPLES 16
+
+/**
+ * Framebuffer update requests sent while polling the server for updates.
+ *
+ * Rather than waiting for each request to be answered before sending the
+ * next, requests are sent at up to the connection's polling rate, and as many
+ * are kept in flight as it takes to cover the round-trip time at that rate,
+ * or to fill the link if that is fewer.
+ */
+typedef struct {
+
+    /**
+     * Maximum number of requests kept in flight, up to
+     * \ref VNC_MAX_UPDATE_REQUESTS; 1 waits for each request to be answered
+     * before sending the next. Defaults to \ref VNC_MAX_UPDATE_REQUESTS.
+     */
+    unsigned max_window;
+
+    /**
+     * Number of requests currently kept in flight.
+     */
+    unsigned window;
+
+    /**
+     * Number of requests sent that are not known to have been answered.
+     */
+    unsigned in_flight;
+
+    /**
+     * Index into `sent` of the oldest request in flight.
+     */
+    unsigned first;
+
+    /**
+     * When each request in flight was sent, on the clock of VNC_Now.
+     */
+    Uint64 sent[VNC_MAX_UPDATE_REQUESTS];
+
+    /**
+     * Whether the last update answered the only request in flight, so that
+     * the server is known to owe nothing.
+     */
+    SDL_bool settled;
+
+    /**
+     * Whether new requests are held back until those in flight have been
+     * answered, so that the pixel format can be changed.
+     */
+    SDL_bool draining;
+
+    /**
+     * When data from the server last arrived, on the clock of VNC_Now.
+     */
+    Uint64 last_message;
+
+    /**
+     * Recent round-trip times, in nanoseconds.
+     */
+    Uint64 rtt_samples[VNC_RTT_SAMPLES];
+
+    /**
+     * Number of round-trip times sampled so far.
+     */
+    unsigned rtt_count;
+
+    /**
+     * When the next request is due, on the clock of VNC_Now, or 0 to send it
+     * straight away. Deadlines are a polling period apart.
+     */
+    Uint64 deadline;
+
+    /**
+     * Average number of bytes transferred per framebuffer update.
+     */
+    double update_bytes;
+
+} VNC_UpdateRequests;
+
+/**
+ * Color depths the server can be asked to send pixel data in.
+ */
+typedef enum {
+    VNC_COLOR_FULL,   /**< The format of the connection's surface. */
+    VNC_COLOR_MEDIUM, /**< 16 bits per pixel, RGB565. */
+    VNC_COLOR_LOW     /**< 8 bits per pixel, BGR233. */
+} VNC_ColorLevel;
+
+/**
+ * Opaque zlib decompression stream state used by compressed encodings.
+ */
+typedef struct VNC_ZlibStream VNC_ZlibStream;
+
+/**
+ * Opaque state used to decode rectangles on threads other than the polling
+ * thread.
+ */
+typedef struct VNC_DecodeScheduler VNC_DecodeScheduler;
+
+/**
+ * Opaque state of the incremental parser that messages from the server are
+ * read with, kept between calls as they arrive.
+ */
+typedef struct VNC_Parser VNC_Parser;
+
+/**
+ * Opaque ring of data received from the server on a thread of its own.
+ */
+typedef struct VNC_ReceiveRing VNC_ReceiveRing;
+
+/**
+ * Opaque buffer of data waiting to be sent to the server.
+ */
+typedef struct VNC_Outbox VNC_Outbox;
+
+/**
+ * Opaque manager of many connections, which are polled by a fixed number of
+ * event loops rather than a thread each.
+ */
+typedef struct VNC_ConnectionManager VNC_ConnectionManager;
+
+/**
+ * Opaque record of the regions of a connection's surface that have changed.
+ */
+typedef struct VNC_Damage VNC_Damage;
+
+/**
+ * Opaque set of framebuffers used to hand frames from the polling thread to
+ * the renderer when triple buffering.
+ */
+typedef struct VNC_FrameBuffers VNC_FrameBuffers;
+
 /**
  * Pixel data format as specified by a VNC server during server initialisation.
  *
@@ -109,7 +316,15 @@ typedef struct {
 typedef struct {
     Uint16 w; /**< Framebuffer width in pixels. */
     Uint16 h; /**< Framebuffer height in pixels. */
-    VNC_PixelFormat fmt; /**< Server's pixel format. */
+
+    /**
+     * Pixel format that the server sends pixel data in.
+     *
+     * Initially announced by the server; replaced by the format of the
+     * connection's surface, or a lower color depth if the connection's
+     * throughput calls for it.
+     */
+    VNC_PixelFormat fmt;
 
     /**
      * Length of the connection's name.
@@ -174,9 +389,77 @@ typedef struct {
     VNC_ConnectionBuffer buffer;
 
     /**
-     * Surface buffer for processing incoming buffer updates.
+     * Buffer that data from the server is read through.
+     */
+    VNC_ReceiveBuffer recv_buffer;
+
+    /**
+     * Ring that a receiver thread fills with data from the server for the
+     * polling thread to parse, so that the two overlap; NULL when the
+     * connection is polled by a connection manager instead.
+     */
+    VNC_ReceiveRing *ring;
+
+    /**
+     * Parser for messages from the server, which picks up where it left off
+     * whenever more data arrives, so that reading them never blocks.
+     */
+    VNC_Parser *parser;
+
+    /**
+     * Statistics about the connection, such as the number of syscalls made.
+     */
+    VNC_ConnectionStats stats;
+
+    /**
+     * Framebuffer update requests in flight while polling the server.
+     */
+    VNC_UpdateRequests requests;
+
+    /**
+     * Decompression stream for ZRLE-encoded rectangles.
+     *
+     * The server's compressor state carries over between rectangles, so this
+     * stream lives as long as the connection does.
+     */
+    VNC_ZlibStream *zrle_stream;
+
+    /**
+     * Decompression streams for Tight-encoded rectangles.
+     *
+     * Tight servers compress using up to four independent streams, which are
+     * reset only when the server says so.
+     */
+    VNC_ZlibStream *tight_streams[4];
+
+    /**
+     * Scheduler handing rectangles to the decode threads shared by all
+     * connections, in the order they must be drawn in.
+     *
+     * Rectangles that write to disjoint parts of the framebuffer, such as
+     * Tight rectangles compressed with different zlib streams, may be decoded
+     * in parallel; the framebuffer is always written to in update order.
+     */
+    VNC_DecodeScheduler *decoder;
+
+    /**
+     * Regions of `surface` changed by framebuffer updates since they were
+     * last taken with VNC_TakeDamage.
+     */
+    VNC_Damage *damage;
+
+    /**
+     * Framebuffers that completed updates are handed to the renderer through,
+     * or `NULL` unless triple buffering was enabled with
+     * VNC_EnableTripleBuffering.
+     */
+    VNC_FrameBuffers *frames;
+
+    /**
+     * Non-zero while a \ref VNC_FRAME_READY event for the connection has been
+     * pushed but no frame has been acquired since.
      */
-    SDL_Surface *scratch_buffer;
+    SDL_atomic_t frame_ready;
 
     /**
      * Details about the server side of the connection.
@@ -185,6 +468,10 @@ typedef struct {
 
     /**
      * Surface containing up-to-date visualisation of the desktop buffer.
+     *
+     * The polling thread writes to this surface, and replaces it when the
+     * framebuffer is resized. When triple buffering, it belongs to the polling
+     * thread alone; use VNC_AcquireFrame to get a frame to draw instead.
      */
     SDL_Surface *surface;
 
@@ -193,8 +480,26 @@ typedef struct {
      */
     SDL_Thread *thread;
 
+    /**
+     * Connection manager whose event loops poll the VNC server instead of a
+     * thread of its own, if it has been added to one.
+     */
+    VNC_ConnectionManager *manager;
+
+    /**
+     * Messages for the server that could not be sent yet without blocking a
+     * connection manager's event loop; NULL until the connection is first
+     * added to a connection manager.
+     */
+    VNC_Outbox *outbox;
+
     /**
      * Maximum polling rate of the polling thread, in hertz.
+     *
+     * Update requests are sent at this rate while the server is polled for
+     * updates, each due at a fixed deadline so that the rate holds steady;
+     * with continuous updates, the server sends them as the framebuffer
+     * changes.
      */
     unsigned fps;
 
@@ -214,8 +519,123 @@ typedef struct {
      */
     SDL_Window *window;
 
+    /**
+     * Lock guarding connection state shared between the polling thread and
+     * the application, such as a pending pixel format change.
+     */
+    SDL_mutex *lock;
+
+    /**
+     * SDL pixel format of `surface`; always 32 bits per pixel.
+     */
+    Uint32 pixel_format;
+
+    /**
+     * SDL pixel format to switch `surface` to once the current framebuffer
+     * update is done, or `SDL_PIXELFORMAT_UNKNOWN` if none.
+     */
+    Uint32 pending_pixel_format;
+
+    /**
+     * Whether the polling thread lowers the color depth requested from the
+     * server when the connection's throughput drops, and raises it again when
+     * throughput recovers. Enabled by default.
+     */
+    SDL_bool adaptive_color;
+
+    /**
+     * Color depth the server is currently asked to send pixel data in.
+     */
+    VNC_ColorLevel color_level;
+
+    /**
+     * Lookup table mapping pixel values sent by the server to pixel values of
+     * `surface`.
+     *
+     * `NULL` if the server sends pixel data in the format of `surface`.
+     */
+    Uint32 *pixel_lut;
+
+    /**
+     * Whether the server has announced support for Fence messages.
+     */
+    SDL_bool supports_fence;
+
+    /**
+     * Whether the server has announced support for continuous updates.
+     */
+    SDL_bool supports_continuous_updates;
+
+    /**
+     * Whether the server sends framebuffer updates as the framebuffer changes,
+     * rather than in answer to update requests.
+     *
+     * Enabled as soon as the server supports both continuous updates and
+     * fences.
+     */
+    SDL_bool continuous_updates;
+
+    /**
+     * Whether the server has been asked for a new pixel format while
+     * continuous updates are enabled, and the fence that marks where it
+     * switches has not been answered yet.
+     */
+    SDL_bool syncing_pixel_format;
+
+    /**
+     * SDL pixel format `surface` switches to once the server switches.
+     */
+    Uint32 sync_pixel_format;
+
+    /**
+     * Color level switched to once the server switches pixel formats.
+     */
+    VNC_ColorLevel sync_color_level;
+
 } VNC_Connection;
 
+/**
+ * Texture that is kept up to date with a connection's framebuffer by
+ * VNC_UpdateStreamingTexture.
+ *
+ * The texture is created once with `SDL_TEXTUREACCESS_STREAMING` in the pixel
+ * format of the connection's surface, and only recreated when the surface's
+ * size or format changes.
+ */
+typedef struct {
+
+    /**
+     * Renderer the texture belongs to.
+     */
+    SDL_Renderer *renderer;
+
+    /**
+     * Texture holding the latest frame of the framebuffer, or `NULL` until
+     * VNC_UpdateStreamingTexture has first been called.
+     */
+    SDL_Texture *texture;
+
+} VNC_StreamingTexture;
+
+/**
+ * Window whose surface is kept up to date with a connection's framebuffer by
+ * VNC_PresentWindowSurface, for when no accelerated renderer is available.
+ */
+typedef struct {
+
+    /**
+     * Window the framebuffer is presented in.
+     */
+    SDL_Window *window;
+
+    /**
+     * Window surface the framebuffer was last presented to, or `NULL` if the
+     * next presentation must redraw the whole window.
+     */
+    SDL_Surface *surface;
+
+} VNC_WindowSurface;
+
 /**
  * Result of SDL2_vnc operations.
  */
@@ -260,7 +680,30 @@ typedef enum {
     /**
      * Current operation or feature is unimplemented in SDL2_vnc.
      */
-    VNC_ERROR_UNIMPLEMENTED
+    VNC_ERROR_UNIMPLEMENTED,
+
+    /**
+     * Pixel format given is not one that VNC can transfer pixel data in.
+     */
+    VNC_ERROR_UNSUPPORTED_PIXEL_FORMAT,
+
+    /**
+     * Operation must be carried out before the connection's polling thread is
+     * started.
+     */
+    VNC_ERROR_ALREADY_STARTED,
+
+    /**
+     * A renderer could not create or update a texture, or a window surface
+     * could not be updated; see SDL_GetError.
+     */
+    VNC_ERROR_RENDERER,
+
+    /**
+     * VNC Server sent data that cannot be valid, such as a length larger than
+     * the rectangle it belongs to could ever need.
+     */
+    VNC_ERROR_MALFORMED_DATA
 
 } VNC_Result;
 
@@ -268,21 +711,60 @@ typedef enum {
  * SDL_Event type ID, for the event in which a VNC server disconnects from
  * SDL2_vnc while the polling thread is still active.
  *
+ * The event's `user.code` is the \ref VNC_Result that ended the connection, if
+ * any, and its `user.data1` the VNC_Connection.
+ *
  * \note Due to the nature of registering events with SDL, `VNC_SHUTDOWN` is not
  *       a constant, and so cannot be switch-cased against.
  */
 extern int VNC_SHUTDOWN;
 
+/**
+ * SDL_Event type ID, for the event in which the polling thread has finished a
+ * framebuffer update that changed the connection's surface.
+ *
+ * Events are coalesced: after one is pushed, no other is pushed for the same
+ * connection until a frame has been acquired with VNC_AcquireFrame, so an
+ * application can block in `SDL_WaitEvent` and redraw only when there is
+ * something new to draw. The event's `user.data1` is the VNC_Connection.
+ *
+ * \note Like \ref VNC_SHUTDOWN, `VNC_FRAME_READY` is not a constant.
+ */
+extern int VNC_FRAME_READY;
+
+/**
+ * Thread count for running one thread per CPU core, for
+ * VNC_InitWithDecodeThreads and VNC_CreateConnectionManager.
+ */
+#define VNC_THREAD_PER_CORE (-1)
+
 /**
  * Initialise SDL2_vnc for use.
  *
  * Must be called before other functions can be used, except VNC_ErrorString.
+ * Starts one decode thread per CPU core; see VNC_InitWithDecodeThreads.
  *
  * \return 0 on successful initialisation; one of the \ref VNC_Result values
  *         otherwise.
  */
 int VNC_Init();
 
+/**
+ * Initialise SDL2_vnc for use, with the given number of decode threads.
+ *
+ * Decode threads are shared by all connections: rectangles and tiles are
+ * decoded on whichever thread is free, while each connection's rectangles
+ * still end up drawn in the order the server sent them. Only the first call
+ * starts them; later calls leave the number of threads as it is.
+ *
+ * \param threads Number of decode threads, or \ref VNC_THREAD_PER_CORE for one
+ *                per CPU core.
+ *
+ * \return 0 on successful initialisation; one of the \ref VNC_Result values
+ *         otherwise.
+ */
+int VNC_InitWithDecodeThreads(int threads);
+
 /**
  * Get a relevant error string for a VNC_Result.
  *
@@ -298,6 +780,13 @@ int VNC_Init();
  */
 char *VNC_ErrorString(VNC_Result err);
 
+/**
+ * Read the monotonic clock that update requests are timed and paced on.
+ *
+ * \return The current time in nanoseconds, from an arbitrary starting point.
+ */
+Uint64 VNC_Now(void);
+
 /**
  * Initialise a VNC connection to a server.
  *
@@ -313,6 +802,111 @@ char *VNC_ErrorString(VNC_Result err);
 VNC_Result VNC_InitConnection(VNC_Connection *vnc, char *host, Uint16 port,
         unsigned fps);
 
+/**
+ * Open a VNC connection to a server without starting its polling thread.
+ *
+ * This does everything VNC_InitConnection does except start the polling
+ * thread, so that options that can only be set before then, such as
+ * VNC_EnableTripleBuffering, can be; start the thread with
+ * VNC_StartConnection afterwards.
+ *
+ * \param vnc  An allocated but not-yet-initialised VNC_Connection struct.
+ * \param host The address of the server's host, specified as an IPv4 4-tuple
+ *             string.
+ * \param port The port of the server to connect through.
+ * \param fps  The maximum polling rate of the connection, in hertz.
+ *
+ * \return 0 on successful connection; one of the \ref VNC_Result values
+ *         otherwise.
+ */
+VNC_Result VNC_OpenConnection(VNC_Connection *vnc, char *host, Uint16 port,
+        unsigned fps);
+
+/**
+ * Start the polling thread of a connection opened with VNC_OpenConnection.
+ *
+ * \param vnc The VNC connection.
+ *
+ * \return 0 on success; one of the \ref VNC_Result values otherwise.
+ */
+VNC_Result VNC_StartConnection(VNC_Connection *vnc);
+
+/**
+ * Have the polling thread hand finished frames to the renderer through a
+ * triple buffer, rather than drawing into the surface that is being read.
+ *
+ * The polling thread decodes into a back buffer of its own, and publishes it
+ * with an atomic swap once a framebuffer update is complete. VNC_AcquireFrame
+ * then gets the latest published frame without ever waiting on the polling
+ * thread, and the frame it returns is not written to or freed until the next
+ * call, so it neither tears nor disappears when the framebuffer is resized.
+ *
+ * Must be called between VNC_OpenConnection and VNC_StartConnection.
+ *
+ * \param vnc The VNC connection.
+ *
+ * \return 0 on success; one of the \ref VNC_Result values otherwise.
+ */
+int VNC_EnableTripleBuffering(VNC_Connection *vnc);
+
+/**
+ * Get the latest complete frame of a connection's framebuffer.
+ *
+ * When triple buffering, the returned surface stays valid and unchanged until
+ * the next call, and VNC_TakeDamage reports what changed in it relative to
+ * frames acquired before. Must only be called from one thread at a time.
+ *
+ * Otherwise, `vnc->surface` is returned.
+ *
+ * \param vnc The VNC connection.
+ *
+ * \return The surface to draw.
+ */
+SDL_Surface *VNC_AcquireFrame(VNC_Connection *vnc);
+
+/**
+ * Set the pixel format of a connection's surface, and ask the server to send
+ * pixel data in that format.
+ *
+ * Pixel data received in the same format as `vnc->surface` can be copied into
+ * it without any per-pixel conversion, and a surface whose format matches that
+ * of a renderer's textures can be uploaded without conversion too. While the
+ * connection's color depth is lowered (see `vnc->adaptive_color`), pixel data
+ * is converted through a lookup table instead.
+ *
+ * VNC_InitConnection uses `SDL_PIXELFORMAT_RGB888`, which most renderers and
+ * window surfaces use natively. Once the polling thread is running, the
+ * change takes effect after the framebuffer update in progress, at which point
+ * `vnc->surface` is recreated in the new format.
+ *
+ * \param vnc    The VNC connection.
+ * \param format An SDL pixel format; must be a packed RGB format of 32 bits
+ *               per pixel.
+ *
+ * \return 0 on success; one of the \ref VNC_Result values otherwise.
+ */
+int VNC_SetPixelFormat(VNC_Connection *vnc, Uint32 format);
+
+/**
+ * Take the region of a connection's surface that has changed since the last
+ * call, so that only that region needs to be redrawn or uploaded.
+ *
+ * A framebuffer update's changes are only reported once the whole update has
+ * been decoded; when triple buffering, once a frame containing them has been
+ * acquired with VNC_AcquireFrame, and only to the thread that acquires frames.
+ * The region is returned as a set of non-empty rectangles, which are merged
+ * further if there are more than `max` of them, and the record of changes is
+ * cleared. A change of the surface's size or pixel format damages
+ * the whole surface.
+ *
+ * \param vnc   The VNC connection.
+ * \param rects Array to store the changed rectangles in.
+ * \param max   Number of rectangles that fit in `rects`; must be at least 1.
+ *
+ * \return The number of rectangles stored in `rects`; 0 if nothing changed.
+ */
+int VNC_TakeDamage(VNC_Connection *vnc, SDL_Rect *rects, int max);
+
 /**
  * Wait on a connection's polling thread.
  *
@@ -326,6 +920,82 @@ VNC_Result VNC_InitConnection(VNC_Connection *vnc, char *host, Uint16 port,
  */
 void VNC_WaitOnConnection(VNC_Connection *vnc);
 
+/**
+ * Create a connection manager, which polls the connections added to it with a
+ * fixed number of event loops.
+ *
+ * Each event loop waits on its share of the connections with `epoll`, parses
+ * whatever data arrives on any of them without blocking, and sends their
+ * update requests as they fall due. A connection that fails is dropped from
+ * the manager, and a \ref VNC_SHUTDOWN event is pushed for it.
+ *
+ * Messages to the server are queued rather than waited on when its socket is
+ * full, and a connection with a backlog of rectangles for the decode threads
+ * is not read from until they catch up. An event loop still waits for a
+ * connection's decode threads at the end of every framebuffer update, before
+ * it decodes a raw or small rectangle over pixels they are working on, and
+ * before the framebuffer is resized or its pixel format changed; the loop's
+ * other connections wait with it.
+ *
+ * \param threads Number of event loop threads; \ref VNC_THREAD_PER_CORE for
+ *                one per CPU core, or 0 for a single event loop that the
+ *                application runs itself with VNC_PollConnections.
+ *
+ * \return The new connection manager; NULL on failure.
+ */
+VNC_ConnectionManager *VNC_CreateConnectionManager(int threads);
+
+/**
+ * Add a connection to a connection manager, which polls it from then on
+ * instead of a polling thread of its own.
+ *
+ * Like VNC_StartConnection, this starts the connection; it goes to whichever
+ * event loop has the fewest connections.
+ *
+ * \param manager The connection manager.
+ * \param vnc     An opened connection that has not been started.
+ *
+ * \return 0 on success; one of the \ref VNC_Result values otherwise.
+ */
+VNC_Result VNC_AddConnection(VNC_ConnectionManager *manager,
+        VNC_Connection *vnc);
+
+/**
+ * Remove a connection from a connection manager, waiting for its event loop to
+ * finish with it.
+ *
+ * Connections that failed have already been removed; removing them again does
+ * nothing.
+ *
+ * \param manager The connection manager.
+ * \param vnc     The connection to remove.
+ */
+void VNC_RemoveConnection(VNC_ConnectionManager *manager,
+        VNC_Connection *vnc);
+
+/**
+ * Run the event loop of a connection manager created without threads once,
+ * waiting for data to arrive on any of its connections or for an update
+ * request to fall due, and handling whatever has.
+ *
+ * \param manager The connection manager.
+ * \param timeout Maximum time to wait, in milliseconds; -1 to wait
+ *                indefinitely.
+ *
+ * \return 0 on success, including if the manager has threads of its own; -1 on
+ *         error.
+ */
+int VNC_PollConnections(VNC_ConnectionManager *manager, int timeout);
+
+/**
+ * Stop and free a connection manager.
+ *
+ * Its connections are left open, but are no longer polled.
+ *
+ * \param manager The connection manager to destroy.
+ */
+void VNC_DestroyConnectionManager(VNC_ConnectionManager *manager);
+
 /**
  * Create a window for displaying the frame buffer in, and associate it with the
  * given connection.
@@ -351,6 +1021,92 @@ void VNC_WaitOnConnection(VNC_Connection *vnc);
 SDL_Window *VNC_CreateWindowForConnection(VNC_Connection *vnc, char *title,
         int x, int y, Uint32 flags);
 
+/**
+ * Prepare a streaming texture for displaying a connection's framebuffer with
+ * the given renderer.
+ *
+ * No texture is created until VNC_UpdateStreamingTexture is first called.
+ *
+ * \param texture  An allocated but not-yet-initialised VNC_StreamingTexture
+ *                 struct.
+ * \param renderer The renderer to create the texture with.
+ */
+void VNC_InitStreamingTexture(VNC_StreamingTexture *texture,
+        SDL_Renderer *renderer);
+
+/**
+ * Bring a streaming texture up to date with the latest frame of a connection's
+ * framebuffer.
+ *
+ * The frame is acquired with VNC_AcquireFrame, and only the rectangles that
+ * VNC_TakeDamage reports as changed are uploaded to `texture->texture`. The
+ * whole frame is uploaded when the texture is first created, and when it is
+ * recreated because the framebuffer changed size or pixel format.
+ *
+ * As this takes the connection's damage, the application should not call
+ * VNC_TakeDamage itself, nor update more than one streaming texture from the
+ * same connection.
+ *
+ * \param texture The streaming texture.
+ * \param vnc     The VNC connection.
+ *
+ * \return 0 on success; one of the \ref VNC_Result values otherwise.
+ */
+int VNC_UpdateStreamingTexture(VNC_StreamingTexture *texture,
+        VNC_Connection *vnc);
+
+/**
+ * Destroy the texture of a streaming texture.
+ *
+ * The streaming texture may be updated again afterwards, which creates a new
+ * texture and uploads the whole frame to it; this is useful when the renderer
+ * has lost the contents of its textures.
+ *
+ * \param texture The streaming texture.
+ */
+void VNC_DestroyStreamingTexture(VNC_StreamingTexture *texture);
+
+/**
+ * Prepare a window for presenting a connection's framebuffer through its
+ * window surface, without a renderer.
+ *
+ * The window must not have a renderer. Setting the connection's pixel format
+ * to that of the window surface with VNC_SetPixelFormat lets frames be copied
+ * into it without conversion.
+ *
+ * \param surface An allocated but not-yet-initialised VNC_WindowSurface
+ *                struct.
+ * \param window  The window to present in.
+ */
+void VNC_InitWindowSurface(VNC_WindowSurface *surface, SDL_Window *window);
+
+/**
+ * Present the latest frame of a connection's framebuffer in a window.
+ *
+ * The frame is acquired with VNC_AcquireFrame, only the rectangles that
+ * VNC_TakeDamage reports as changed are copied into the window surface, and
+ * only those are passed to `SDL_UpdateWindowSurfaceRects`. The whole window is
+ * redrawn the first time, when SDL replaces the window surface, and after
+ * VNC_InvalidateWindowSurface.
+ *
+ * As this takes the connection's damage, the application should not call
+ * VNC_TakeDamage itself.
+ *
+ * \param surface The window surface.
+ * \param vnc     The VNC connection.
+ *
+ * \return 0 on success; one of the \ref VNC_Result values otherwise.
+ */
+int VNC_PresentWindowSurface(VNC_WindowSurface *surface, VNC_Connection *vnc);
+
+/**
+ * Have the next VNC_PresentWindowSurface redraw the whole window, such as when
+ * the window is exposed or resized.
+ *
+ * \param surface The window surface.
+ */
+void VNC_InvalidateWindowSurface(VNC_WindowSurface *surface);
+
 /**
  * Send a keypress event to the VNC server.
  *
@@ -0,0 +1,208 @@
+/*
+ * Microbenchmark of Hextile decoding on text-like content.
+ *
+ * Synthetic tiles with a background, a foreground and many small
+ * subrectangles, as sent for a terminal or an editor, are decoded once with
+ * VNC_DecodeHextile, whose fills go through VNC_FillRect and VNC_FillSpan, and
+ * once by the same tile walk filling with SDL_FillRect.
+ *
+ * The decoder's internals are not part of the library's interface, so the
+ * library is compiled into this program rather than linked.
+ */
+#include "SDL2_vnc.c"
+
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1088
+#define BENCH_SUBRECTS 40
+#define BENCH_ROUNDS 50
+
+/*
+ * Deterministic pseudo-random numbers, so every run decodes the same tiles.
+ */
+Uint32 bench_random(Uint32 *state) {
+    *state = *state * 1664525 + 1013904223;
+    return *state >> 8;
+}
+
+void bench_put_pixel(Uint8 **p, Uint32 pixel, uint bytes_pp) {
+    SDL_memcpy(*p, &pixel, bytes_pp);
+    *p += bytes_pp;
+}
+
+/*
+ * Encodes a w by h rectangle as Hextile tiles that each carry a background,
+ * a foreground and BENCH_SUBRECTS glyph-sized subrectangles.
+ */
+Uint8 *bench_encode(int w, int h, uint bytes_pp, size_t *size) {
+    int tiles = ((w + 15) / 16) * ((h + 15) / 16);
+    size_t tile_size = 1 + 2 * bytes_pp + 1 + 2 * BENCH_SUBRECTS;
+    Uint8 *data = SDL_malloc(tiles * tile_size);
+    Uint8 *p = data;
+    Uint32 state = 1;
+
+    if (!data) {
+        return NULL;
+    }
+
+    for (int y = 0; y < h; y += 16) {
+        for (int x = 0; x < w; x += 16) {
+            int tw = SDL_min(16, w - x);
+            int th = SDL_min(16, h - y);
+
+            *p++ = VNC_HEXTILE_BACKGROUND | VNC_HEXTILE_FOREGROUND |
+                VNC_HEXTILE_ANY_SUBRECTS;
+            bench_put_pixel(&p, bench_random(&state), bytes_pp);
+            bench_put_pixel(&p, bench_random(&state), bytes_pp);
+            *p++ = BENCH_SUBRECTS;
+
+            /* strokes of glyphs: one or two pixels thick, up to 6 long */
+            for (int i = 0; i < BENCH_SUBRECTS; i++) {
+                Uint32 r = bench_random(&state);
+                int sw = (r & 1) ? 1 + (r >> 1) % 2 : 1 + (r >> 1) % 6;
+                int sh = (r & 1) ? 1 + (r >> 4) % 6 : 1 + (r >> 4) % 2;
+                sw = SDL_min(sw, tw);
+                sh = SDL_min(sh, th);
+
+                int sx = (r >> 8) % (tw - sw + 1);
+                int sy = (r >> 12) % (th - sh + 1);
+
+                *p++ = sx << 4 | sy;
+                *p++ = (sw - 1) << 4 | (sh - 1);
+            }
+        }
+    }
+
+    *size = p - data;
+    return data;
+}
+
+/*
+ * Walks the tiles the way VNC_DecodeHextile does, but fills with SDL_FillRect.
+ * Only handles the tiles bench_encode produces.
+ */
+int bench_decode_sdl(VNC_Connection *vnc, SDL_Rect *r,
+        VNC_ByteReader *reader) {
+
+    VNC_PixelFormat *fmt = &vnc->server_details.fmt;
+    uint bytes_pp = fmt->bpp / 8;
+
+    for (int y = 0; y < r->h; y += 16) {
+        for (int x = 0; x < r->w; x += 16) {
+            SDL_Rect tile = {
+                r->x + x, r->y + y, SDL_min(16, r->w - x), SDL_min(16, r->h - y)
+            };
+
+            Uint8 *p = VNC_ReadBytes(reader, 2 + 2 * bytes_pp);
+            if (!p) {
+                return -1;
+            }
+
+            Uint32 bg = VNC_PixelFromBytes(p + 1, bytes_pp,
+                    fmt->is_big_endian);
+            Uint32 fg = VNC_PixelFromBytes(p + 1 + bytes_pp, bytes_pp,
+                    fmt->is_big_endian);
+            uint count = p[1 + 2 * bytes_pp];
+
+            SDL_FillRect(vnc->surface, &tile, bg);
+
+            p = VNC_ReadBytes(reader, 2 * count);
+            if (!p) {
+                return -1;
+            }
+
+            for (uint i = 0; i < count; i++, p += 2) {
+                SDL_Rect sub = {
+                    tile.x + (p[0] >> 4), tile.y + (p[0] & 0x0f),
+                    (p[1] >> 4) + 1, (p[1] & 0x0f) + 1
+                };
+
+                SDL_FillRect(vnc->surface, &sub, fg);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Decodes the data BENCH_ROUNDS times, and returns the seconds taken per round.
+ */
+double bench_run(VNC_Connection *vnc, SDL_Rect *r, Uint8 *data, size_t size,
+        int (*decode)(VNC_Connection *, SDL_Rect *, VNC_ByteReader *)) {
+
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        VNC_ByteReader reader = { data, size, 0 };
+
+        if (decode(vnc, r, &reader)) {
+            fprintf(stderr, "decoding failed\n");
+            exit(1);
+        }
+    }
+
+    Uint64 ticks = SDL_GetPerformanceCounter() - start;
+
+    return (double) ticks / SDL_GetPerformanceFrequency() / BENCH_ROUNDS;
+}
+
+int bench_format(Uint32 format) {
+    static VNC_Connection vnc;
+    SDL_Rect r = { 0, 0, BENCH_WIDTH, BENCH_HEIGHT };
+    size_t size;
+
+    if (VNC_PixelFormatFromSDL(format, &vnc.server_details.fmt)) {
+        return -1;
+    }
+
+    vnc.pixel_format = format;
+    vnc.server_details.w = r.w;
+    vnc.server_details.h = r.h;
+
+    uint bytes_pp = vnc.server_details.fmt.bpp / 8;
+    Uint8 *data = bench_encode(r.w, r.h, bytes_pp, &size);
+
+    vnc.surface = SDL_CreateRGBSurfaceWithFormat(0, r.w, r.h,
+            vnc.server_details.fmt.bpp, format);
+
+    SDL_Surface *reference = SDL_CreateRGBSurfaceWithFormat(0, r.w, r.h,
+            vnc.server_details.fmt.bpp, format);
+
+    if (!data || !vnc.surface || !reference) {
+        return -1;
+    }
+
+    double direct = bench_run(&vnc, &r, data, size, VNC_DecodeHextile);
+    SDL_memcpy(reference->pixels, vnc.surface->pixels,
+            (size_t) r.h * vnc.surface->pitch);
+
+    double sdl = bench_run(&vnc, &r, data, size, bench_decode_sdl);
+    int same = !SDL_memcmp(vnc.surface->pixels, reference->pixels,
+            (size_t) r.h * vnc.surface->pitch);
+
+    double mpixels = (double) r.w * r.h / 1e6;
+
+    printf("%s, %i subrects per tile:\n", SDL_GetPixelFormatName(format),
+            BENCH_SUBRECTS);
+    printf("  VNC_FillRect  %8.3f ms/frame %8.1f Mpixel/s\n",
+            direct * 1e3, mpixels / direct);
+    printf("  SDL_FillRect  %8.3f ms/frame %8.1f Mpixel/s\n",
+            sdl * 1e3, mpixels / sdl);
+    printf("  speedup %.2fx%s\n", sdl / direct,
+            same ? "" : ", OUTPUT DIFFERS");
+
+    SDL_FreeSurface(reference);
+    SDL_FreeSurface(vnc.surface);
+    SDL_free(data);
+
+    return same ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int res = 0;
+
+    res |= bench_format(SDL_PIXELFORMAT_RGB888);
+    res |= bench_format(SDL_PIXELFORMAT_RGB565);
+
+    return res ? 1 : 0;
+}
@@ -1,5 +1,7 @@
 { stdenv
 , SDL2
+, zlib
+, libjpeg
 , patchelf
 }:
 
@@ -9,7 +11,7 @@ stdenv.mkDerivation {
 
   src = ./.;
 
-  buildInputs = [ SDL2 patchelf ];
+  buildInputs = [ SDL2 zlib libjpeg patchelf ];
   makeFlags = [ "PREFIX=$(out)" ];
 
   postInstall = ''
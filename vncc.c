@@ -55,21 +55,70 @@ int main(int argc, char **argv) {
     VNC_Init();
 
     VNC_Connection vnc;
-    int connection_result = VNC_InitConnection(&vnc, host, port, 60);
+    int connection_result = VNC_OpenConnection(&vnc, host, port, 60);
     exit_on_vnc_error(connection_result);
 
     SDL_Window *wind = VNC_CreateWindowForConnection(&vnc, NULL,
             SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 0);
     exit_on_sdl_error(!wind);
 
-    SDL_Renderer *rend = SDL_CreateRenderer(wind, -1, 0);
-    exit_on_sdl_error(!rend);
+    /*
+     * Without an accelerated renderer, drawing through a texture only adds a
+     * copy; present through the window surface instead.
+     */
+    SDL_Renderer *rend = SDL_CreateRenderer(wind, -1, SDL_RENDERER_ACCELERATED);
+
+    VNC_StreamingTexture text;
+    VNC_WindowSurface wsurf;
+
+    if (rend) {
+        SDL_RendererInfo info;
+        exit_on_sdl_error(SDL_GetRendererInfo(rend, &info));
+
+        /*
+         * Prefer a 32-bit format without alpha, which VNC never sends, but
+         * settle for one with it.
+         */
+        SDL_bool format_set = SDL_FALSE;
+
+        for (int alpha = 0; alpha < 2 && !format_set; alpha++) {
+            for (Uint32 i = 0; i < info.num_texture_formats; i++) {
+                Uint32 format = info.texture_formats[i];
+
+                if (SDL_BITSPERPIXEL(format) == 32 &&
+                        SDL_ISPIXELFORMAT_ALPHA(format) == alpha &&
+                        !VNC_SetPixelFormat(&vnc, format)) {
+                    format_set = SDL_TRUE;
+                    break;
+                }
+            }
+        }
+
+        VNC_InitStreamingTexture(&text, rend);
+
+    } else {
+        SDL_Surface *surface = SDL_GetWindowSurface(wind);
+        exit_on_sdl_error(!surface);
+
+        /* window surfaces that are not 32-bit are converted to when drawn */
+        VNC_SetPixelFormat(&vnc, surface->format->format);
+
+        VNC_InitWindowSurface(&wsurf, wind);
+    }
+
+    exit_on_vnc_error(VNC_EnableTripleBuffering(&vnc));
+    exit_on_vnc_error(VNC_StartConnection(&vnc));
 
     SDL_bool running = SDL_TRUE;
 
     while (running) {
         SDL_Event e;
-        while (SDL_PollEvent(&e)) {
+        SDL_bool redraw = SDL_FALSE;
+
+        /* sleep until there is input or a new frame to draw */
+        exit_on_sdl_error(!SDL_WaitEvent(&e));
+
+        do {
             switch (e.type) {
                 case SDL_QUIT:
                     running = SDL_FALSE;
@@ -102,23 +151,46 @@ int main(int argc, char **argv) {
                     break;
                 }
 
+                case SDL_WINDOWEVENT:
+                    if (e.window.event == SDL_WINDOWEVENT_EXPOSED ||
+                            e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                        if (!rend) {
+                            VNC_InvalidateWindowSurface(&wsurf);
+                        }
+                        redraw = SDL_TRUE;
+                    }
+                    break;
+
+                case SDL_RENDER_DEVICE_RESET:
+                    VNC_DestroyStreamingTexture(&text);
+                    redraw = SDL_TRUE;
+                    break;
+
                 default:
                     if (e.type == VNC_SHUTDOWN) {
                         exit_on_vnc_error(e.user.code);
                         running = SDL_FALSE;
+
+                    } else if (e.type == VNC_FRAME_READY) {
+                        redraw = SDL_TRUE;
                     }
                     break;
             }
 
-        }
+        } while (SDL_PollEvent(&e));
 
-        SDL_Texture *text = SDL_CreateTextureFromSurface(rend, vnc.surface);
-        SDL_RenderCopy(rend, text, NULL, NULL);
-        SDL_DestroyTexture(text);
+        if (!running || !redraw) {
+            continue;
+        }
 
-        SDL_RenderPresent(rend);
+        if (rend) {
+            exit_on_vnc_error(VNC_UpdateStreamingTexture(&text, &vnc));
+            SDL_RenderCopy(rend, text.texture, NULL, NULL);
+            SDL_RenderPresent(rend);
 
-        SDL_Delay(1000/vnc.fps);
+        } else {
+            exit_on_vnc_error(VNC_PresentWindowSurface(&wsurf, &vnc));
+        }
     }
 
     return 0;